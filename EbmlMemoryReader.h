@@ -0,0 +1,188 @@
+/*
+ *  Part of the foobar2000 Matroska plugin
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ *  WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*!
+    \file EbmlMemoryReader.h
+		\version $Id$
+    \brief Decoding of EBML element headers held in memory, without libebml objects
+*/
+
+#ifndef _EBML_MEMORY_READER_H_
+#define _EBML_MEMORY_READER_H_
+
+#include "ebml/EbmlTypes.h"
+#include <string.h>
+
+using namespace LIBEBML_NAMESPACE;
+
+/// The largest element header: a 4 byte ID and an 8 byte coded size
+#define EBML_MAX_HEADER_SIZE 12
+
+/// Length in bytes of an EBML variable size integer, from its first byte
+/// \return 0 if the first byte is not a valid length marker
+inline unsigned int EbmlCodedLength(binary first)
+{
+	unsigned int length = 1;
+	for (binary mask = 0x80; mask != 0; mask >>= 1, length++) {
+		if (first & mask)
+			return length;
+	}
+	return 0;
+}
+
+/// Reads an element ID, the length marker is kept like in EbmlId::Value
+/// \return The number of bytes used, 0 if the ID is invalid or truncated
+inline unsigned int ReadEbmlId(const binary *buffer, size_t size, uint32 &id)
+{
+	if (size == 0)
+		return 0;
+	unsigned int length = EbmlCodedLength(buffer[0]);
+	if (length == 0 || length > 4 || length > size)
+		return 0;
+	id = 0;
+	for (unsigned int i = 0; i < length; i++)
+		id = (id << 8) | buffer[i];
+	return length;
+}
+
+/// Reads a coded size (or any unsigned EBML varint, like a block track number)
+/// \param sizeUnknown Set when all the value bits are set, the "unknown size" marker
+/// \return The number of bytes used, 0 if the value is invalid or truncated
+inline unsigned int ReadEbmlCodedSize(const binary *buffer, size_t size, uint64 &value, bool &sizeUnknown)
+{
+	if (size == 0)
+		return 0;
+	unsigned int length = EbmlCodedLength(buffer[0]);
+	if (length == 0 || length > size)
+		return 0;
+	binary mask = (binary)(0xFF >> length);
+	value = buffer[0] & mask;
+	sizeUnknown = (value == mask);
+	for (unsigned int i = 1; i < length; i++) {
+		value = (value << 8) | buffer[i];
+		if (buffer[i] != 0xFF)
+			sizeUnknown = false;
+	}
+	return length;
+}
+
+/// Big-endian unsigned integer element data
+inline uint64 ReadEbmlUInteger(const binary *buffer, uint64 size)
+{
+	uint64 value = 0;
+	for (uint64 i = 0; i < size && i < 8; i++)
+		value = (value << 8) | buffer[i];
+	return value;
+}
+
+/// Finds the next occurrence of an element ID, memchr() looks for its first
+/// byte and only those candidates are compared in full
+/// \param id The ID with its length marker, like in EbmlId::Value
+/// \return The offset of the ID, or size if it is not found
+inline size_t FindEbmlId(const binary *buffer, size_t size, uint32 id, size_t start = 0)
+{
+	binary idBytes[4];
+	unsigned int idLength = 0;
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		binary b = (binary)(id >> shift);
+		if (idLength != 0 || b != 0)
+			idBytes[idLength++] = b;
+	}
+	if (idLength == 0)
+		return size;
+
+	while (start < size && size - start >= idLength) {
+		const binary *first = static_cast<const binary *>(memchr(buffer + start, idBytes[0], size - start - idLength + 1));
+		if (first == NULL)
+			break;
+		if (memcmp(first + 1, idBytes + 1, idLength - 1) == 0)
+			return first - buffer;
+		start = (first - buffer) + 1;
+	}
+	return size;
+}
+
+/// Tells if the buffer starts with the last bytes of an element ID, the first
+/// ones being just before it
+/// \param id The ID with its length marker, like in EbmlId::Value
+inline bool IsEbmlIdCut(const binary *buffer, size_t size, uint32 id)
+{
+	binary idBytes[4];
+	unsigned int idLength = 0;
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		binary b = (binary)(id >> shift);
+		if (idLength != 0 || b != 0)
+			idBytes[idLength++] = b;
+	}
+	for (unsigned int cut = 1; cut < idLength; cut++) {
+		if (size >= idLength - cut && memcmp(buffer, idBytes + cut, idLength - cut) == 0)
+			return true;
+	}
+	return false;
+}
+
+struct EbmlElementHeader {
+	uint32 id;
+	/// Size of the element data
+	uint64 size;
+	/// Size of the ID and coded size
+	unsigned int headSize;
+	bool sizeUnknown;
+};
+
+/// Reads the ID and size of the element starting at buffer
+/// \return false if the header is invalid or doesn't fit in size bytes
+inline bool ReadEbmlElementHeader(const binary *buffer, size_t size, EbmlElementHeader &header)
+{
+	unsigned int idLength = ReadEbmlId(buffer, size, header.id);
+	if (idLength == 0)
+		return false;
+	unsigned int sizeLength = ReadEbmlCodedSize(buffer + idLength, size - idLength, header.size, header.sizeUnknown);
+	if (sizeLength == 0)
+		return false;
+	header.headSize = idLength + sizeLength;
+	return true;
+}
+
+/// Walks the children of an element whose data is held in memory
+class EbmlMemoryWalker {
+public:
+	EbmlMemoryWalker(const binary *buffer, size_t size)
+		: m_Buffer(buffer), m_Size(size), m_Pos(0), m_DataPos(0) {};
+
+	/// Moves to the next child
+	/// \return false at the end of the data, or on a broken or unknown sized child
+	bool Next(EbmlElementHeader &header) {
+		if (m_Pos >= m_Size)
+			return false;
+		if (!ReadEbmlElementHeader(m_Buffer + m_Pos, m_Size - m_Pos, header) || header.sizeUnknown)
+			return false;
+		if (header.size > m_Size - m_Pos - header.headSize)
+			return false;
+		m_DataPos = m_Pos + header.headSize;
+		m_Pos = m_DataPos + static_cast<size_t>(header.size);
+		return true;
+	};
+	/// Data of the current child
+	const binary *GetData() const { return m_Buffer + m_DataPos; };
+	/// Offset of the data of the current child from the start of the buffer
+	size_t GetDataPos() const { return m_DataPos; };
+
+protected:
+	const binary *m_Buffer;
+	size_t m_Size;
+	size_t m_Pos;
+	size_t m_DataPos;
+};
+
+#endif // _EBML_MEMORY_READER_H_
@@ -0,0 +1,127 @@
+/*
+ *  Part of the foobar2000 Matroska plugin
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ *  WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*!
+    \file EbmlStreamReader.h
+		\version $Id$
+    \brief Forward-only reading of EBML elements from a stream that can't seek
+*/
+
+#ifndef _EBML_STREAM_READER_H_
+#define _EBML_STREAM_READER_H_
+
+#include "EbmlMemoryReader.h"
+#include "ebml/IOCallback.h"
+#include <vector>
+
+using namespace LIBEBML_NAMESPACE;
+
+/// Reads a stream front to back, the next bytes can be looked at before they
+/// are consumed. Only what is asked for is read, so a live stream is never
+/// waited on for more data than the element being parsed.
+class EbmlStreamReader {
+public:
+	/// \param lookahead Most bytes Fill() can be asked for
+	EbmlStreamReader(IOCallback &input, size_t lookahead)
+		: m_Input(input), m_Lookahead(lookahead), m_Start(0), m_End(0), m_Position(0) {};
+
+	/// Drops the buffered bytes, the input is now at position
+	void Reset(uint64 position) {
+		m_Start = 0;
+		m_End = 0;
+		m_Position = position;
+	};
+	/// Position of the next byte Peek() returns
+	uint64 GetPosition() const { return m_Position; };
+
+	/// Makes the next size bytes available to Peek(), size is clamped to the lookahead
+	/// \return The number of bytes available, less than size at the end of the stream
+	size_t Fill(size_t size) {
+		if (size > m_Lookahead)
+			size = m_Lookahead;
+		if (m_End - m_Start >= size)
+			return m_End - m_Start;
+		if (m_Buffer.size() < m_Lookahead)
+			m_Buffer.resize(m_Lookahead);
+		if (m_Start + size > m_Buffer.size()) {
+			// Move what is left to the front
+			memmove(&m_Buffer[0], &m_Buffer[m_Start], m_End - m_Start);
+			m_End -= m_Start;
+			m_Start = 0;
+		}
+		while (m_End - m_Start < size) {
+			uint32 bytesRead = m_Input.read(&m_Buffer[m_End], m_Start + size - m_End);
+			if (bytesRead == 0)
+				break;
+			m_End += bytesRead;
+		}
+		return m_End - m_Start;
+	};
+	/// The bytes made available by Fill()
+	const binary *Peek() const { return &m_Buffer[m_Start]; };
+
+	/// Looks at the header of the next element without consuming it
+	/// \return false at the end of the stream or if the header is invalid
+	bool PeekElementHeader(EbmlElementHeader &header) {
+		size_t available = Fill(EBML_MAX_HEADER_SIZE);
+		if (available == 0)
+			return false;
+		return ReadEbmlElementHeader(Peek(), available, header);
+	};
+
+	/// Consumes size bytes, the ones past the lookahead are read straight into dest
+	/// \param dest Receives the bytes, NULL to drop them
+	/// \return The number of bytes consumed, less than size at the end of the stream
+	uint64 Read(binary *dest, uint64 size) {
+		uint64 done = m_End - m_Start;
+		if (done > size)
+			done = size;
+		if (dest != NULL && done > 0)
+			memcpy(dest, &m_Buffer[m_Start], static_cast<size_t>(done));
+		m_Start += static_cast<size_t>(done);
+		while (done < size) {
+			uint32 bytesRead;
+			if (dest != NULL) {
+				bytesRead = m_Input.read(dest + done, static_cast<size_t>(size - done));
+			} else {
+				// Dropped data goes through the lookahead buffer
+				m_Start = 0;
+				m_End = 0;
+				if (m_Buffer.size() < m_Lookahead)
+					m_Buffer.resize(m_Lookahead);
+				size_t count = m_Buffer.size();
+				if (count > size - done)
+					count = static_cast<size_t>(size - done);
+				bytesRead = m_Input.read(&m_Buffer[0], count);
+			}
+			if (bytesRead == 0)
+				break;
+			done += bytesRead;
+		}
+		m_Position += done;
+		return done;
+	};
+	/// \return The number of bytes skipped, less than size at the end of the stream
+	uint64 Skip(uint64 size) { return Read(NULL, size); };
+
+protected:
+	IOCallback &m_Input;
+	size_t m_Lookahead;
+	std::vector<binary> m_Buffer;
+	/// Range of m_Buffer read from the stream and not consumed yet
+	size_t m_Start;
+	size_t m_End;
+	uint64 m_Position;
+};
+
+#endif // _EBML_STREAM_READER_H_
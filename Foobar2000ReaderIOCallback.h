@@ -18,39 +18,123 @@
 
 #include "../SDK/foobar2000.h"
 #include "ebml/IOCallback.h"
+#include <vector>
 
 using namespace LIBEBML_NAMESPACE;
 
+/// Default read-ahead window, libebml mostly asks for a few bytes at a time
+#define READ_AHEAD_WINDOW_SIZE (64 * 1024)
+#define READ_AHEAD_WINDOW_COUNT 2
+
 class Foobar2000ReaderIOCallback : public IOCallback {
 public:
 	Foobar2000ReaderIOCallback(service_ptr_t<file> & source, abort_callback & p_abort)
-		: m_abort(p_abort)
+		: m_OpenAbort(p_abort), m_abort(&p_abort)
 	{
 		m_Reader = source;
 		if (!m_Reader->can_seek()) {
 			m_NoSeekReader = source;
 		}
+		m_Position = 0;
+		m_ReaderPosition = 0;
+		m_UseCount = 0;
+		m_Hits = 0;
+		m_Misses = 0;
+		m_DirectReads = 0;
+		if (seekable()) {
+			m_Position = m_Reader->get_position(*m_abort);
+			m_ReaderPosition = m_Position;
+		}
+		SetReadAhead(READ_AHEAD_WINDOW_SIZE, READ_AHEAD_WINDOW_COUNT);
 	};
 
 	virtual ~Foobar2000ReaderIOCallback() {
 		close();
 	};
 
+	/// Sets up the read-ahead cache, small reads and seeks are then served
+	/// from windowCount aligned windows of windowSize bytes
+	/// \param windowCount 0 disables the cache
+	void SetReadAhead(uint32 windowSize, uint32 windowCount) {
+		m_WindowSize = windowSize;
+		m_Windows.clear();
+		if (!seekable() || windowSize == 0)
+			return;
+		m_Windows.resize(windowCount);
+	};
+
 	virtual uint32 read(void*Buffer, size_t Size) {
-		return m_Reader->read(Buffer, Size, m_abort);
+		if (m_Windows.empty())
+			return m_Reader->read(Buffer, Size, *m_abort);
+
+		if (Size >= m_WindowSize) {
+			// Large reads go straight to the file
+			m_DirectReads++;
+			SyncReader();
+			uint32 bytesRead = m_Reader->read(Buffer, Size, *m_abort);
+			m_Position += bytesRead;
+			m_ReaderPosition = m_Position;
+			return bytesRead;
+		}
+
+		uint32 bytesRead = 0;
+		binary *dest = static_cast<binary *>(Buffer);
+		while (bytesRead < Size) {
+			ReadWindow &window = GetWindow(m_Position);
+			size_t offset = static_cast<size_t>(m_Position - window.start);
+			if (offset >= window.data.size())
+				// End of the file
+				break;
+			size_t count = window.data.size() - offset;
+			if (count > Size - bytesRead)
+				count = Size - bytesRead;
+			memcpy(dest + bytesRead, &window.data[offset], count);
+			bytesRead += static_cast<uint32>(count);
+			m_Position += count;
+		}
+		return bytesRead;
 	};
 
 	virtual void setFilePointer(int64 Offset, seek_mode Mode=seek_beginning) {
+		if (m_NoSeekReader != NULL && Mode != seek_end) {
+			// A stream only goes forward, what is seeked over is read and dropped
+			uint64 position = m_Reader->get_position(*m_abort);
+			uint64 target = (Mode == seek_current) ? position + Offset : Offset;
+			if (target >= position) {
+				m_Reader->skip(target - position, *m_abort);
+				return;
+			}
+		}
+		if (m_Windows.empty()) {
+			switch (Mode)
+			{
+				case seek_beginning:
+					m_Reader->seek(Offset, *m_abort);
+					break;
+				case seek_current:
+					m_Reader->seek_ex(Offset, file::seek_from_current, *m_abort);
+					break;
+				case seek_end:
+					m_Reader->seek_ex(Offset, file::seek_from_eof, *m_abort);
+					break;
+				default:
+					//throw "Invalid Seek Mode!!!";
+					;
+			};
+			return;
+		}
+
+		// The file is only seeked when it has to be read
 		switch (Mode)
 		{
 			case seek_beginning:
-				m_Reader->seek(Offset, m_abort);
+				m_Position = Offset;
 				break;
 			case seek_current:
-				m_Reader->seek_ex(Offset, file::seek_from_current, m_abort);
+				m_Position += Offset;
 				break;
 			case seek_end:
-				m_Reader->seek_ex(Offset, file::seek_from_eof, m_abort);
+				m_Position = m_Reader->get_size(*m_abort) + Offset;
 				break;
 			default:
 				//throw "Invalid Seek Mode!!!";
@@ -59,12 +143,20 @@ public:
 	}
 
 	virtual size_t write(const void*Buffer, size_t Size) {
-		m_Reader->write(Buffer, Size, m_abort);
+		if (!m_Windows.empty()) {
+			InvalidateWindows();
+			SyncReader();
+		}
+		m_Reader->write(Buffer, Size, *m_abort);
+		m_Position += Size;
+		m_ReaderPosition = m_Position;
 		return Size;
 	}
 
 	virtual uint64 getFilePointer() {
-		return m_Reader->get_position(m_abort);
+		if (m_Windows.empty())
+			return m_Reader->get_position(*m_abort);
+		return m_Position;
 	};
 
 	virtual void close() {
@@ -76,16 +168,97 @@ public:
 		return false;
 	};
 
-	bool truncate()
+	virtual bool truncate()
 	{
-		m_Reader->set_eof(m_abort);
+		if (!m_Windows.empty()) {
+			InvalidateWindows();
+			SyncReader();
+		}
+		m_Reader->set_eof(*m_abort);
 		return true;
 	}
 
+	/// Reads made on another thread check p_abort, NULL goes back to the one given at open
+	void SetAbort(abort_callback *p_abort) { m_abort = (p_abort != NULL) ? p_abort : &m_OpenAbort; };
+
+	/// Size and timestamp of the source, which grows while it is being recorded
+	t_filestats GetStats() { return m_Reader->get_stats(*m_abort); };
+	/// The source grew, the data cached up to its old end has to be read again
+	virtual void Refresh() { InvalidateWindows(); };
+
+	/// Reads served by the read-ahead windows
+	uint64 GetHits() { return m_Hits; };
+	/// Windows loaded from the file
+	uint64 GetMisses() { return m_Misses; };
+	/// Reads too large for the windows
+	uint64 GetDirectReads() { return m_DirectReads; };
+
 protected:
+	struct ReadWindow {
+		ReadWindow() { start = 0; lastUse = 0; };
+
+		uint64 start;
+		uint64 lastUse;
+		/// Shorter than the window size at the end of the file, empty when unused
+		std::vector<binary> data;
+	};
+
+	/// Returns the window holding pos, loading it in the least recently used slot if needed
+	ReadWindow &GetWindow(uint64 pos) {
+		uint64 start = pos - (pos % m_WindowSize);
+		size_t oldest = 0;
+		for (size_t w = 0; w < m_Windows.size(); w++) {
+			ReadWindow &window = m_Windows[w];
+			if (window.start == start && !window.data.empty()) {
+				m_Hits++;
+				window.lastUse = ++m_UseCount;
+				return window;
+			}
+			if (window.lastUse < m_Windows[oldest].lastUse)
+				oldest = w;
+		}
+
+		m_Misses++;
+		ReadWindow &window = m_Windows[oldest];
+		window.start = start;
+		window.lastUse = ++m_UseCount;
+		window.data.resize(m_WindowSize);
+		if (m_ReaderPosition != start)
+			m_Reader->seek(start, *m_abort);
+		uint32 bytesRead = m_Reader->read(&window.data[0], m_WindowSize, *m_abort);
+		window.data.resize(bytesRead);
+		m_ReaderPosition = start + bytesRead;
+		return window;
+	};
+
+	void InvalidateWindows() {
+		for (size_t w = 0; w < m_Windows.size(); w++)
+			m_Windows[w].data.clear();
+	};
+
+	/// Moves the file to the position seen by libebml
+	void SyncReader() {
+		if (m_ReaderPosition != m_Position) {
+			m_Reader->seek(m_Position, *m_abort);
+			m_ReaderPosition = m_Position;
+		}
+	};
+
 	service_ptr_t<file> m_Reader;
 	service_ptr_t<file> m_NoSeekReader;
-	abort_callback & m_abort;
+	abort_callback & m_OpenAbort;
+	abort_callback * m_abort;
+
+	/// Position seen by libebml
+	uint64 m_Position;
+	/// Actual position of m_Reader
+	uint64 m_ReaderPosition;
+	uint32 m_WindowSize;
+	std::vector<ReadWindow> m_Windows;
+	uint64 m_UseCount;
+	uint64 m_Hits;
+	uint64 m_Misses;
+	uint64 m_DirectReads;
 };
 
 #endif // _FOOBAR2000_IO_CALLBACK_H_
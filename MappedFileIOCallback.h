@@ -0,0 +1,204 @@
+/*
+ *  Part of the foobar2000 Matroska plugin
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ *  WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*!
+    \file MappedFileIOCallback.h
+		\version $Id$
+    \brief Reading of local files through a memory mapping
+*/
+
+#ifndef _MAPPED_FILE_IO_CALLBACK_H_
+#define _MAPPED_FILE_IO_CALLBACK_H_
+
+#include "Foobar2000ReaderIOCallback.h"
+
+/// Size of the mapped view, small enough for the 32 bit address space
+#define MAPPED_VIEW_SIZE (16 * 1024 * 1024)
+
+/// Serves reads and seeks from a view of the file mapped in memory, so they
+/// don't go through the foobar2000 file service at all.
+/// Writes go to the source file, the mapping is dropped on the first one.
+class MappedFileIOCallback : public Foobar2000ReaderIOCallback {
+public:
+	/// \param nativePath Path of the file on a local drive, see GetLocalPath()
+	MappedFileIOCallback(service_ptr_t<file> & source, abort_callback & p_abort, const char *nativePath)
+		: Foobar2000ReaderIOCallback(source, p_abort)
+	{
+		m_Mapping = NULL;
+		m_View = NULL;
+		m_ViewStart = 0;
+		m_ViewSize = 0;
+		m_MapSize = 0;
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		m_Granularity = systemInfo.dwAllocationGranularity;
+
+		HANDLE hFile = CreateFileW(pfc::stringcvt::string_wide_from_utf8(nativePath), GENERIC_READ,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0
+			&& (uint64)fileSize.QuadPart == m_Reader->get_size(*m_abort)) {
+			m_Mapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+			m_MapSize = fileSize.QuadPart;
+		}
+		// The mapping keeps the file open
+		CloseHandle(hFile);
+		if (m_Mapping != NULL) {
+			// Not needed with the whole file at hand
+			SetReadAhead(0, 0);
+		}
+	};
+
+	virtual ~MappedFileIOCallback() {
+		Unmap();
+	};
+
+	/// Native path of p_path when it is a file on a fixed local drive, where
+	/// a mapped view can't fail on a lost connection or a removed medium
+	static bool GetLocalPath(const char *p_path, pfc::string_base &p_out) {
+		pfc::string8 nativePath;
+		if (p_path == NULL || !extract_native_path(p_path, nativePath))
+			return false;
+		if (nativePath.length() < 3 || nativePath.get_ptr()[1] != ':' || nativePath.get_ptr()[2] != '\\')
+			return false;
+		pfc::string8 root(nativePath, 3);
+		if (GetDriveTypeW(pfc::stringcvt::string_wide_from_utf8(root)) != DRIVE_FIXED)
+			return false;
+		p_out = nativePath;
+		return true;
+	};
+
+	bool IsMapped() { return m_Mapping != NULL; };
+
+	virtual uint32 read(void*Buffer, size_t Size) {
+		if (!IsMapped())
+			return Foobar2000ReaderIOCallback::read(Buffer, Size);
+
+		uint32 bytesRead = 0;
+		binary *dest = static_cast<binary *>(Buffer);
+		while (bytesRead < Size && m_Position < m_MapSize) {
+			if (m_Position < m_ViewStart || m_Position >= m_ViewStart + m_ViewSize)
+				MapView(m_Position);
+			size_t count = static_cast<size_t>(m_ViewStart + m_ViewSize - m_Position);
+			if (count > Size - bytesRead)
+				count = Size - bytesRead;
+			if (!CopyFromView(dest + bytesRead, m_View + static_cast<size_t>(m_Position - m_ViewStart), count))
+				throw exception_io_data();
+			bytesRead += static_cast<uint32>(count);
+			m_Position += count;
+		}
+		return bytesRead;
+	};
+
+	virtual void setFilePointer(int64 Offset, seek_mode Mode=seek_beginning) {
+		if (!IsMapped()) {
+			Foobar2000ReaderIOCallback::setFilePointer(Offset, Mode);
+			return;
+		}
+		switch (Mode)
+		{
+			case seek_beginning:
+				m_Position = Offset;
+				break;
+			case seek_current:
+				m_Position += Offset;
+				break;
+			case seek_end:
+				m_Position = m_MapSize + Offset;
+				break;
+			default:
+				;
+		};
+	};
+
+	virtual size_t write(const void*Buffer, size_t Size) {
+		SwitchToReader();
+		return Foobar2000ReaderIOCallback::write(Buffer, Size);
+	};
+
+	virtual uint64 getFilePointer() {
+		if (!IsMapped())
+			return Foobar2000ReaderIOCallback::getFilePointer();
+		return m_Position;
+	};
+
+	virtual bool truncate() {
+		SwitchToReader();
+		return Foobar2000ReaderIOCallback::truncate();
+	};
+
+	/// The mapping keeps the old size, a file that grows is read through the source from then on
+	virtual void Refresh() {
+		SwitchToReader();
+		Foobar2000ReaderIOCallback::Refresh();
+	};
+
+protected:
+	void MapView(uint64 pos) {
+		if (m_View != NULL) {
+			UnmapViewOfFile(m_View);
+			m_View = NULL;
+			m_ViewSize = 0;
+		}
+		uint64 start = pos - (pos % m_Granularity);
+		uint64 size = m_MapSize - start;
+		if (size > MAPPED_VIEW_SIZE)
+			size = MAPPED_VIEW_SIZE;
+		m_View = static_cast<const binary *>(MapViewOfFile(m_Mapping, FILE_MAP_READ,
+			static_cast<DWORD>(start >> 32), static_cast<DWORD>(start), static_cast<SIZE_T>(size)));
+		if (m_View == NULL)
+			throw exception_io();
+		m_ViewStart = start;
+		m_ViewSize = size;
+	};
+
+	/// A page that can't be read raises an exception instead of an error code
+	static bool CopyFromView(void *dest, const void *src, size_t size) {
+		__try {
+			memcpy(dest, src, size);
+		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+			return false;
+		}
+		return true;
+	};
+
+	void Unmap() {
+		if (m_View != NULL)
+			UnmapViewOfFile(m_View);
+		if (m_Mapping != NULL)
+			CloseHandle(m_Mapping);
+		m_View = NULL;
+		m_Mapping = NULL;
+		m_ViewStart = 0;
+		m_ViewSize = 0;
+	};
+
+	/// The file is about to change, go on with the read-ahead windows of the source
+	void SwitchToReader() {
+		if (!IsMapped())
+			return;
+		Unmap();
+		SetReadAhead(READ_AHEAD_WINDOW_SIZE, READ_AHEAD_WINDOW_COUNT);
+	};
+
+	HANDLE m_Mapping;
+	const binary *m_View;
+	uint64 m_ViewStart;
+	uint64 m_ViewSize;
+	uint64 m_MapSize;
+	DWORD m_Granularity;
+};
+
+#endif // _MAPPED_FILE_IO_CALLBACK_H_
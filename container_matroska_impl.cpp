@@ -14,7 +14,8 @@ void container_matroska_impl::open(const char * p_path, bool p_info_only, foobar
     service_ptr_t<file> file_ptr;
     try {
         filesystem::g_open_read(file_ptr, m_path, *m_abort);
-        matroska_parser_ptr parser = matroska_parser_ptr(new MatroskaAudioParser(file_ptr, *m_abort));
+        matroska_parser_ptr parser = matroska_parser_ptr(new MatroskaAudioParser(file_ptr, *m_abort, m_path));
+        parser->SetCacheKey(m_path, file_ptr->get_stats(*m_abort));
         parser->Parse(p_info_only);
         for (t_size i = 0; i != parser->GetAttachmentList().get_count(); ++i) {
             MatroskaAttachment & item = parser->GetAttachmentList().get_item(i);
@@ -60,6 +60,12 @@ int YourAllocHook(int allocType, void *userData, size_t size, int blockType, lon
 #include "resource.h"
 #include "DbgOut.h"
 
+namespace {
+    // {A2EF38F6-945A-4B1B-8AC1-DCF6D40FCA6A}
+    const GUID guid_cfg_prefetch = { 0xa2ef38f6, 0x945a, 0x4b1b, { 0x8a, 0xc1, 0xdc, 0xf6, 0xd4, 0x0f, 0xca, 0x6a } };
+    advconfig_checkbox_factory g_cfg_prefetch("Matroska: parse the next clusters while decoding", guid_cfg_prefetch, advconfig_branch::guid_branch_decoding, 0, true);
+}
+
 class input_matroska
 {
     matroska_parser_ptr m_parser;
@@ -92,7 +98,6 @@ class input_matroska
 
 public:
 	service_ptr_t<file> m_file;
-	pfc::array_t<t_uint8> m_buffer;
 	
 public:
 	input_matroska()
@@ -141,7 +146,8 @@ public:
 		input_open_file_helper(m_file, p_path, p_reason, p_abort);
         m_reason = p_reason;
 
-        m_parser = matroska_parser_ptr(new MatroskaAudioParser(m_file, p_abort));
+        m_parser = matroska_parser_ptr(new MatroskaAudioParser(m_file, p_abort, p_path));
+        m_parser->SetCacheKey(p_path, m_file->get_stats(p_abort));
         if (m_parser->Parse(!(m_reason & input_open_decode))) {
 		    console::error("Matroska: Invalid Matroska file.");
 		    cleanup();
@@ -218,6 +224,9 @@ public:
 
 	t_filestats get_file_stats(abort_callback & p_abort) {
 		hprintf(L"Matroska: get_file_stats()\n");
+		// The prefetch thread reads from the same file
+		if (m_parser.get() != NULL)
+			m_parser->StopPrefetch();
 		return m_file->get_stats(p_abort);
 	}
 
@@ -228,11 +237,19 @@ public:
 		// The timecode scale in Matroska is in milliseconds, but foobar deals in seconds
 		m_timescale = m_parser->GetTimecodeScale() * 1000;
 		m_length = duration_to_samples(m_parser->GetDuration());
+		bool recording = m_parser->IsRecording();
+		if (m_length == 0 || recording)
+			// A live stream or a file being recorded plays until it ends
+			m_length = MAX_UINT64;
 		m_position = 0;
 		m_skip_samples = 0;
 		m_skip_frames = 0;
 		m_frame_remaining = 0;
 		m_frame = 0;
+		// The next clusters are parsed while the current one is decoded
+		m_parser->EnablePrefetch(g_cfg_prefetch.get());
+		// Play on when the end of a file still being recorded is reached
+		m_parser->SetFollowMode(recording);
 		if (decode_can_seek()) {
 			decode_seek(0, p_abort);
 		}
@@ -256,9 +273,8 @@ public:
 
 		do
 		{
-			//unsigned char *buffer = NULL;
+			const unsigned char *buffer = NULL;
 			unsigned int buffer_size = 0;
-			bool skip_this_frame = false;
 /*
 			{
 				int64 delta = duration_to_samples(m_frame.timecode) - m_position;
@@ -269,12 +285,11 @@ public:
 			if (m_frame_remaining==0 || m_frame==0)
 			{
                 if (m_frame!=0) {
-					delete m_frame;
-                    m_frame = NULL;
+					release_frame();
                 }
                 hprintf(L"Matroska: decode_run() start ReadSingleFrame()\n");
                 try {
-    				m_frame = m_parser->ReadSingleFrame();
+    				m_frame = m_parser->ReadSingleFrame(p_abort);
                 } catch (const pfc::exception & e) {
                     hprintf(L"Matroska: ReadSingleFrame(): exception=%s\n", e.what());
                     cleanup();
@@ -284,7 +299,7 @@ public:
                     hprintf(L"Matroska: decode_run() return false: m_frame=0\n");
 					return false;
                 }
-				m_frame_remaining = m_frame->dataBuffer.size();
+				m_frame_remaining = m_frame->GetLaceCount();
                 if (m_frame_remaining == 0) {
                     hprintf(L"Matroska: decode_run() return false: m_frame_remaining=0\n");
                     cleanup();
@@ -294,17 +309,24 @@ public:
 
 			{
                 hprintf(L"Matroska: decode_run() buffer set\n");
-				unsigned ptr = m_frame->dataBuffer.size() - (m_frame_remaining--);
-				//buffer = (unsigned char*)&m_frame->dataBuffer.at(ptr)[0];
-				buffer_size = m_frame->dataBuffer.at(ptr).size();
-				m_buffer.set_size(buffer_size);
-				m_buffer.set_data_fromptr(&m_frame->dataBuffer.at(ptr)[0], buffer_size);
+				unsigned ptr = m_frame->GetLaceCount() - (m_frame_remaining--);
+				// The decoder reads the lace straight from the cluster buffer of the parser
+				buffer = m_frame->GetLaceData(ptr);
+				buffer_size = m_frame->GetLaceSize(ptr);
+			}
+
+			if (m_skip_frames>1)
+			{
+				// The seek started the parser before the pre-roll the decoder asked for,
+				// frames ahead of it are dropped without being decoded
+				m_skip_frames--;
+				continue;
 			}
 			
 			m_tempchunk.reset();
 			try {
                 hprintf(L"Matroska: decode_run() start decode()\n");
-				m_decoder->decode(m_buffer.get_ptr(), buffer_size, m_tempchunk, p_abort);
+				m_decoder->decode(buffer, buffer_size, m_tempchunk, p_abort);
                 if (m_tempchunk.is_empty() && m_frame->add_id > 0) {
                     m_decoder->decode(&m_frame->additional_data_buffer.at(0), m_frame->additional_data_buffer.size(), m_tempchunk, p_abort);
                 }
@@ -325,17 +347,16 @@ public:
 				m_vbr_update_time += (m_vbr_last_duration = m_tempchunk.get_duration());
 			}
 
-			// TODO : maybe we could not decode the skipped frame to get faster seeking ???
-
 			if (m_skip_frames>0)
 			{
-				skip_this_frame = true;
+				// The last frame before the pre-roll is decoded to prime the decoder,
+				// its output is thrown away
 				m_skip_frames--;
+				continue;
 			}
 
+			{
 
-			if (!skip_this_frame)
-			{				
 				uint64 offset = duration_to_samples(0);//m_frame.timecode);
 				uint64 duration = duration_to_samples(m_frame->get_duration());
 				//			console::info(uStringPrintf("duration: %u, offset: %u",duration,offset));
@@ -484,6 +505,8 @@ public:
 	}
 
 	void decode_on_idle(abort_callback & p_abort) {
+		if (m_parser.get() != NULL)
+			m_parser->StopPrefetch();
 		m_file->on_idle(p_abort);
 	}
 
@@ -513,18 +536,17 @@ public:
 			// Just to be safe check for ones without x-
 			// However, You're supposed to use x-* unless it's offically registered
 			|| !stricmp_utf8(p_content_type, "audio/matroska") 
-			|| !stricmp_utf8(p_content_type, "video/matroska");
+			|| !stricmp_utf8(p_content_type, "video/matroska")
+			|| !stricmp_utf8(p_content_type, "audio/webm")
+			|| !stricmp_utf8(p_content_type, "video/webm");
 	}
 
 	static bool g_is_our_path(const char * p_path,const char * p_extension) {
 		hprintf(L"Matroska: g_is_our_path() p_path=%S p_extension=%S\n", p_path, p_extension);
-		if (stricmp_utf8_partial(p_path, "http://", 7) == 0) {
-			// HTTP streams and chapters togther are not supported, requires seeking
+		// HTTP streams are read front to back, chapters and seeking need the whole file
+		if (stricmp_utf8(p_extension, "MKA") != 0 && stricmp_utf8(p_extension, "MKV") != 0
+			&& stricmp_utf8(p_extension, "WEBM") != 0)
 			return false;
-		} else {
-			if (stricmp_utf8(p_extension, "MKA") != 0 && stricmp_utf8(p_extension, "MKV") != 0)
-				return false;
-		}
 		return true;
 	}
 
@@ -540,8 +562,7 @@ protected:
 		*/
 		if (m_frame)
 		{
-			delete m_frame;
-			m_frame = NULL;
+			release_frame();
 		}
         /*
 		if (m_parser != NULL) {
@@ -550,6 +571,16 @@ protected:
 		}
         */
 	}
+	// Frames come from the frame pool of the parser
+	void release_frame()
+	{
+		if (m_parser.get() != NULL)
+			m_parser->ReleaseFrame(m_frame);
+		else
+			delete m_frame;
+		m_frame = NULL;
+	}
+
 	int64 duration_to_samples(double val)
 	{
         return audio_math::time_to_samples(val, m_expected_sample_rate);
@@ -612,8 +643,7 @@ protected:
 		//*
 		if (!p_decode && m_decoder->analyze_first_frame_supported()) {
 			if (m_frame != NULL) {
-				delete m_frame;
-				m_frame = NULL;
+				release_frame();
 			}
 			// The timecode scale in Matroska is in milliseconds, but foobar deals in seconds
 			m_timescale = m_parser->GetTimecodeScale() * 1000;
@@ -625,10 +655,7 @@ protected:
 			m_frame = 0;
 			m_frame = m_parser->ReadFirstFrame();
 			if (m_frame != NULL) {
-				unsigned int buffer_size = m_frame->dataBuffer.at(0).size();
-				m_buffer.set_size(buffer_size);
-				m_buffer.set_data_fromptr(&m_frame->dataBuffer.at(0).at(0), buffer_size);
-				m_decoder->analyze_first_frame(m_buffer.get_ptr(), buffer_size, p_abort);
+				m_decoder->analyze_first_frame(m_frame->GetLaceData(0), m_frame->GetLaceSize(0), p_abort);
 			}
 		}
 		//*/
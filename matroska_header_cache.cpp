@@ -0,0 +1,106 @@
+#include "matroska_header_cache.h"
+
+#include <map>
+
+/**
+ * matroska_header_cache
+ */
+
+namespace {
+    struct header_cache_entry {
+        t_filestats m_stats;
+        matroska_header_cache::header_ptr m_header;
+        t_size m_size;
+        t_uint64 m_last_use;
+    };
+
+    typedef std::map<std::string, header_cache_entry> header_cache_map;
+
+    critical_section g_cache_sync;
+    header_cache_map g_cache;
+    t_size g_cache_size = 0;
+    t_uint64 g_cache_clock = 0;
+
+    std::string get_cache_key(const char * p_path) {
+        pfc::string8 canonical;
+        if (!filesystem::g_get_canonical_path(p_path, canonical)) {
+            canonical = p_path;
+        }
+        return std::string(canonical.get_ptr());
+    }
+
+    bool is_stats_valid(const t_filestats & p_stats) {
+        return p_stats.m_size != filesize_invalid && p_stats.m_timestamp != filetimestamp_invalid;
+    }
+
+    void remove_entry(header_cache_map::iterator p_entry) {
+        g_cache_size -= p_entry->second.m_size;
+        g_cache.erase(p_entry);
+    }
+}
+
+matroska_header_cache::header_ptr matroska_header_cache::g_find(const char * p_path, const t_filestats & p_stats, bool p_need_index) {
+    if (!is_stats_valid(p_stats)) {
+        return header_ptr();
+    }
+    std::string key = get_cache_key(p_path);
+
+    insync(g_cache_sync);
+    header_cache_map::iterator entry = g_cache.find(key);
+    if (entry == g_cache.end()) {
+        return header_ptr();
+    }
+    if (entry->second.m_stats.m_size != p_stats.m_size || entry->second.m_stats.m_timestamp != p_stats.m_timestamp) {
+        // The file changed since
+        remove_entry(entry);
+        return header_ptr();
+    }
+    if (p_need_index && !entry->second.m_header->indexed) {
+        return header_ptr();
+    }
+    entry->second.m_last_use = ++g_cache_clock;
+    return entry->second.m_header;
+}
+
+void matroska_header_cache::g_add(const char * p_path, const t_filestats & p_stats, const header_ptr & p_header) {
+    if (!is_stats_valid(p_stats) || p_header.get() == NULL) {
+        return;
+    }
+    t_size size = p_header->GetMemorySize();
+    if (size > max_memory / 4) {
+        return;
+    }
+    std::string key = get_cache_key(p_path);
+
+    insync(g_cache_sync);
+    header_cache_map::iterator entry = g_cache.find(key);
+    if (entry != g_cache.end()) {
+        remove_entry(entry);
+    }
+    while (!g_cache.empty() && g_cache_size + size > max_memory) {
+        header_cache_map::iterator oldest = g_cache.begin();
+        for (header_cache_map::iterator walk = g_cache.begin(); walk != g_cache.end(); ++walk) {
+            if (walk->second.m_last_use < oldest->second.m_last_use) {
+                oldest = walk;
+            }
+        }
+        remove_entry(oldest);
+    }
+
+    header_cache_entry & new_entry = g_cache[key];
+    new_entry.m_stats = p_stats;
+    new_entry.m_header = p_header;
+    new_entry.m_size = size;
+    new_entry.m_last_use = ++g_cache_clock;
+    g_cache_size += size;
+}
+
+void matroska_header_cache::g_remove(const char * p_path) {
+    std::string key = get_cache_key(p_path);
+
+    insync(g_cache_sync);
+    header_cache_map::iterator entry = g_cache.find(key);
+    if (entry != g_cache.end()) {
+        remove_entry(entry);
+    }
+}
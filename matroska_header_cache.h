@@ -0,0 +1,45 @@
+/*
+ *  Part of the foobar2000 Matroska plugin
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ *  WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*!
+    \file matroska_header_cache.h
+		\version $Id$
+    \brief Process-wide cache of parsed Matroska headers
+*/
+
+#ifndef _MATROSKA_HEADER_CACHE_H_
+#define _MATROSKA_HEADER_CACHE_H_
+
+#include "matroska_parser.h"
+
+/// Shares the result of MatroskaAudioParser::Parse() between the input,
+/// container and filesystem services, which all open the same files.
+/// Entries are keyed by canonical path, size and timestamp and are never
+/// modified once added, the least recently used ones are dropped when the
+/// total goes over max_memory.
+class matroska_header_cache {
+public:
+    typedef boost::shared_ptr<const MatroskaHeaderInfo> header_ptr;
+
+    static const t_size max_memory = 16 * 1024 * 1024;
+
+    /// \param p_need_index Only accept an entry holding the cluster and cue indexes
+    /// \return The cached header, or an empty pointer
+    static header_ptr g_find(const char * p_path, const t_filestats & p_stats, bool p_need_index);
+    /// Adds or replaces the entry of p_path
+    static void g_add(const char * p_path, const t_filestats & p_stats, const header_ptr & p_header);
+    /// Drops the entry of p_path, for when the file is being modified
+    static void g_remove(const char * p_path);
+};
+
+#endif // _MATROSKA_HEADER_CACHE_H_
@@ -0,0 +1,268 @@
+#include "matroska_index_cache.h"
+
+/**
+ * matroska_index_cache
+ */
+
+namespace {
+    // "MKIX"
+    const t_uint32 index_cache_magic = 0x58494B4D;
+    const t_uint32 index_cache_version = 2;
+
+    struct index_cache_header {
+        t_uint32 m_magic;
+        t_uint32 m_version;
+        t_uint64 m_file_size;
+        t_uint64 m_file_timestamp;
+        t_uint64 m_scan_position;
+        t_uint64 m_scan_timecode;
+        t_uint64 m_duration;
+        t_uint32 m_scan_done;
+        t_uint32 m_path_length;
+        t_uint32 m_cluster_count;
+        t_uint32 m_cue_count;
+    };
+
+    // The header is followed by the path of the Matroska file, padded to 8 bytes,
+    // then the cluster entries and the cue points
+    inline t_size padded_path_length(t_size p_length) {
+        return (p_length + 7) & ~7;
+    }
+
+    critical_section g_cache_sync;
+
+    bool parse_index(const t_uint8 * p_view, t_size p_size, const char * p_path, const t_filestats & p_stats, matroska_index_cache::view & p_out) {
+        const index_cache_header * header = reinterpret_cast<const index_cache_header *>(p_view);
+        if (header->m_magic != index_cache_magic || header->m_version != index_cache_version) {
+            return false;
+        }
+        if (header->m_file_size != p_stats.m_size || header->m_file_timestamp != p_stats.m_timestamp) {
+            // The file changed since it was indexed
+            return false;
+        }
+        t_size path_length = strlen(p_path);
+        t_uint64 expected_size = sizeof(index_cache_header) + padded_path_length(header->m_path_length)
+            + (t_uint64)header->m_cluster_count * sizeof(matroska_index_cache::cluster)
+            + (t_uint64)header->m_cue_count * sizeof(matroska_index_cache::cue);
+        if (expected_size != p_size || header->m_path_length != path_length) {
+            return false;
+        }
+        p_view += sizeof(index_cache_header);
+        if (memcmp(p_view, p_path, path_length) != 0) {
+            // Hash collision
+            return false;
+        }
+        p_view += padded_path_length(path_length);
+
+        p_out.m_clusters = reinterpret_cast<const matroska_index_cache::cluster *>(p_view);
+        p_out.m_cluster_count = header->m_cluster_count;
+        p_view += header->m_cluster_count * sizeof(matroska_index_cache::cluster);
+        p_out.m_cues = reinterpret_cast<const matroska_index_cache::cue *>(p_view);
+        p_out.m_cue_count = header->m_cue_count;
+
+        p_out.m_scan_position = header->m_scan_position;
+        p_out.m_scan_timecode = header->m_scan_timecode;
+        p_out.m_scan_done = header->m_scan_done != 0;
+        p_out.m_duration = header->m_duration;
+        return true;
+    }
+
+    struct cache_file_info {
+        pfc::string8 m_path;
+        t_uint64 m_size;
+        t_uint64 m_last_use;
+    };
+
+    bool cache_file_older(const cache_file_info & p_file1, const cache_file_info & p_file2) {
+        return p_file1.m_last_use < p_file2.m_last_use;
+    }
+}
+
+void matroska_index_cache::view::close() {
+    if (m_view != NULL) {
+        UnmapViewOfFile(m_view);
+        m_view = NULL;
+    }
+    if (m_mapping != NULL) {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+    m_clusters = NULL;
+    m_cluster_count = 0;
+    m_cues = NULL;
+    m_cue_count = 0;
+}
+
+bool matroska_index_cache::g_open(const char * p_path, const t_filestats & p_stats, view & p_out) {
+    p_out.close();
+    if (p_stats.m_size == filesize_invalid || p_stats.m_timestamp == filetimestamp_invalid) {
+        return false;
+    }
+    pfc::string8 cache_file;
+    if (!g_get_cache_file(p_path, cache_file)) {
+        return false;
+    }
+
+    HANDLE file = CreateFileW(pfc::stringcvt::string_wide_from_utf8(cache_file), GENERIC_READ | FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool ret = false;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart >= sizeof(index_cache_header) && (t_uint64)file_size.QuadPart <= max_size) {
+        // The mapping keeps the file open, the cache file is replaced rather than written to
+        p_out.m_mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (p_out.m_mapping != NULL) {
+            p_out.m_view = MapViewOfFile(p_out.m_mapping, FILE_MAP_READ, 0, 0, 0);
+            if (p_out.m_view != NULL) {
+                ret = parse_index(static_cast<const t_uint8 *>(p_out.m_view), static_cast<t_size>(file_size.QuadPart), p_path, p_stats, p_out);
+            }
+        }
+    }
+    if (ret) {
+        // The last write time doubles as the last use time for the eviction
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(file, NULL, NULL, &now);
+    } else {
+        p_out.close();
+    }
+    CloseHandle(file);
+    return ret;
+}
+
+void matroska_index_cache::g_store(const char * p_path, const t_filestats & p_stats, const data & p_data) {
+    if (p_stats.m_size == filesize_invalid || p_stats.m_timestamp == filetimestamp_invalid) {
+        return;
+    }
+    pfc::string8 directory, cache_file;
+    if (!g_get_cache_directory(directory) || !g_get_cache_file(p_path, cache_file)) {
+        return;
+    }
+
+    t_size path_length = strlen(p_path);
+    t_uint64 size = sizeof(index_cache_header) + padded_path_length(path_length)
+        + (t_uint64)p_data.m_clusters.size() * sizeof(cluster)
+        + (t_uint64)p_data.m_cues.size() * sizeof(cue);
+    if (size > max_size / 4) {
+        // Not worth evicting a good part of the cache for
+        return;
+    }
+
+    std::vector<t_uint8> buffer(static_cast<t_size>(size), 0);
+    t_uint8 * ptr = &buffer[0];
+    index_cache_header * header = reinterpret_cast<index_cache_header *>(ptr);
+    header->m_magic = index_cache_magic;
+    header->m_version = index_cache_version;
+    header->m_file_size = p_stats.m_size;
+    header->m_file_timestamp = p_stats.m_timestamp;
+    header->m_scan_position = p_data.m_scan_position;
+    header->m_scan_timecode = p_data.m_scan_timecode;
+    header->m_duration = p_data.m_duration;
+    header->m_scan_done = p_data.m_scan_done ? 1 : 0;
+    header->m_path_length = static_cast<t_uint32>(path_length);
+    header->m_cluster_count = static_cast<t_uint32>(p_data.m_clusters.size());
+    header->m_cue_count = static_cast<t_uint32>(p_data.m_cues.size());
+    ptr += sizeof(index_cache_header);
+    memcpy(ptr, p_path, path_length);
+    ptr += padded_path_length(path_length);
+    if (!p_data.m_clusters.empty()) {
+        memcpy(ptr, &p_data.m_clusters[0], p_data.m_clusters.size() * sizeof(cluster));
+        ptr += p_data.m_clusters.size() * sizeof(cluster);
+    }
+    cue * cues = reinterpret_cast<cue *>(ptr);
+    for (t_size i = 0; i != p_data.m_cues.size(); ++i) {
+        const MatroskaCuePoint & cue_point = p_data.m_cues.at(i);
+        cues[i].m_timecode = cue_point.timecode;
+        cues[i].m_cluster_position = cue_point.clusterPos;
+        cues[i].m_relative_position = cue_point.relativePos;
+        cues[i].m_block_number = cue_point.blockNumber;
+        cues[i].m_track = cue_point.track;
+    }
+
+    insync(g_cache_sync);
+    // Write to a temporary file first, a reader must never see half an index
+    pfc::string8 temp_file(cache_file);
+    temp_file << ".tmp";
+    pfc::stringcvt::string_wide_from_utf8 temp_file_w(temp_file);
+    HANDLE file = CreateFileW(temp_file_w, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    DWORD written = 0;
+    BOOL ok = WriteFile(file, &buffer[0], static_cast<DWORD>(buffer.size()), &written, NULL);
+    CloseHandle(file);
+    if (!ok || written != buffer.size()
+        || !MoveFileExW(temp_file_w, pfc::stringcvt::string_wide_from_utf8(cache_file), MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileW(temp_file_w);
+        return;
+    }
+    g_evict(directory, cache_file);
+}
+
+bool matroska_index_cache::g_get_cache_directory(pfc::string_base & p_out) {
+    pfc::string8 directory;
+    if (!extract_native_path(core_api::get_profile_path(), directory)) {
+        return false;
+    }
+    directory << "\\matroska_index";
+    pfc::stringcvt::string_wide_from_utf8 directory_w(directory);
+    if (!CreateDirectoryW(directory_w, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        return false;
+    }
+    p_out = directory;
+    return true;
+}
+
+bool matroska_index_cache::g_get_cache_file(const char * p_path, pfc::string_base & p_out) {
+    pfc::string8 directory;
+    if (!g_get_cache_directory(directory)) {
+        return false;
+    }
+    // 64-bit FNV-1a of the path, collisions are caught by the path stored in the entry
+    t_uint64 hash = 0xCBF29CE484222325ULL;
+    for (const char * ptr = p_path; *ptr; ++ptr) {
+        hash ^= static_cast<t_uint8>(*ptr);
+        hash *= 0x100000001B3ULL;
+    }
+    p_out = directory;
+    p_out << "\\" << pfc::format_hex(hash, 16) << ".idx";
+    return true;
+}
+
+void matroska_index_cache::g_evict(const char * p_directory, const char * p_keep) {
+    std::vector<cache_file_info> files;
+    t_uint64 total_size = 0;
+
+    pfc::string8 pattern(p_directory);
+    pattern << "\\*.idx";
+    WIN32_FIND_DATAW find_data;
+    HANDLE find = FindFirstFileW(pfc::stringcvt::string_wide_from_utf8(pattern), &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        cache_file_info info;
+        info.m_path = p_directory;
+        info.m_path << "\\" << pfc::stringcvt::string_utf8_from_wide(find_data.cFileName);
+        info.m_size = ((t_uint64)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+        info.m_last_use = ((t_uint64)find_data.ftLastWriteTime.dwHighDateTime << 32) | find_data.ftLastWriteTime.dwLowDateTime;
+        total_size += info.m_size;
+        files.push_back(info);
+    } while (FindNextFileW(find, &find_data));
+    FindClose(find);
+
+    if (total_size <= max_size) {
+        return;
+    }
+    std::sort(files.begin(), files.end(), cache_file_older);
+    for (t_size i = 0; i != files.size() && total_size > max_size; ++i) {
+        if (stricmp_utf8(files.at(i).m_path, p_keep) == 0) {
+            continue;
+        }
+        if (DeleteFileW(pfc::stringcvt::string_wide_from_utf8(files.at(i).m_path))) {
+            total_size -= files.at(i).m_size;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ *  Part of the foobar2000 Matroska plugin
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ *  WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*!
+    \file matroska_index_cache.h
+		\version $Id$
+    \brief On-disk cache of the resolved cluster and cue indexes
+*/
+
+#ifndef _MATROSKA_INDEX_CACHE_H_
+#define _MATROSKA_INDEX_CACHE_H_
+
+#include "matroska_parser.h"
+
+/// Keeps the resolved seek index of each file in a small binary file under
+/// the foobar2000 profile, so repeat opens don't have to rebuild it.
+/// Entries are keyed by path, size and timestamp of the Matroska file and
+/// evicted least recently used first once the cache grows over max_size.
+class matroska_index_cache {
+public:
+    struct cluster {
+        t_uint64 m_position;
+        t_uint64 m_timecode;
+    };
+
+    /// A cue point as stored in the cache file
+    struct cue {
+        t_uint64 m_timecode;
+        t_uint64 m_cluster_position;
+        t_uint64 m_relative_position;
+        t_uint32 m_block_number;
+        t_uint32 m_track;
+    };
+
+    /// An entry of the cache, the clusters and cues point into the mapped
+    /// cache file and are valid until close()
+    class view {
+    public:
+        view() : m_clusters(NULL), m_cluster_count(0), m_cues(NULL), m_cue_count(0),
+            m_scan_position(0), m_scan_timecode(0), m_scan_done(false), m_duration(0),
+            m_mapping(NULL), m_view(NULL) {}
+        ~view() { close(); }
+        void close();
+
+        const cluster * m_clusters;
+        t_size m_cluster_count;
+        const cue * m_cues;
+        t_size m_cue_count;
+        t_uint64 m_scan_position;
+        t_uint64 m_scan_timecode;
+        bool m_scan_done;
+        /// Segment duration in nanoseconds, found by a scan when the Info has none
+        t_uint64 m_duration;
+
+    private:
+        view(const view &);
+        void operator=(const view &);
+
+        HANDLE m_mapping;
+        const void * m_view;
+
+        friend class matroska_index_cache;
+    };
+
+    struct data {
+        std::vector<cluster> m_clusters;
+        std::vector<MatroskaCuePoint> m_cues;
+        t_uint64 m_scan_position;
+        t_uint64 m_scan_timecode;
+        bool m_scan_done;
+        /// Segment duration in nanoseconds, found by a scan when the Info has none
+        t_uint64 m_duration;
+    };
+
+    /// Total size of the cache files
+    static const t_uint64 max_size = 32 * 1024 * 1024;
+
+    /// Memory maps the cache file of p_path, nothing is copied
+    /// \return false if there is no valid entry for this path and stats
+    static bool g_open(const char * p_path, const t_filestats & p_stats, view & p_out);
+    /// Writes the index of p_path, evicting old entries when the cache is full
+    static void g_store(const char * p_path, const t_filestats & p_stats, const data & p_data);
+
+private:
+    static bool g_get_cache_directory(pfc::string_base & p_out);
+    static bool g_get_cache_file(const char * p_path, pfc::string_base & p_out);
+    static void g_evict(const char * p_directory, const char * p_keep);
+};
+
+#endif // _MATROSKA_INDEX_CACHE_H_
@@ -0,0 +1,69 @@
+#include "matroska_info_batch.h"
+
+/**
+ * matroska_info_batch
+ */
+
+void matroska_info_batch::g_read(std::vector<item> & p_items, abort_callback & p_abort, t_size p_threads) {
+    if (p_items.empty()) {
+        return;
+    }
+    if (p_threads == 0) {
+        // The opens mostly wait on I/O, more threads than processors pay off
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        p_threads = system_info.dwNumberOfProcessors * 2;
+    }
+    p_threads = pfc::min_t<t_size>(pfc::min_t<t_size>(p_threads, max_threads), p_items.size());
+
+    context batch;
+    batch.m_items = &p_items;
+    batch.m_abort = &p_abort;
+    batch.m_next = 0;
+
+    // The calling thread is one of the readers
+    std::vector<HANDLE> threads;
+    for (t_size i = 1; i < p_threads; ++i) {
+        DWORD thread_id;
+        HANDLE thread = CreateThread(NULL, 0, g_thread_proc, &batch, 0, &thread_id);
+        if (thread == NULL) {
+            break;
+        }
+        threads.push_back(thread);
+    }
+    g_run(batch);
+    for (t_size i = 0; i != threads.size(); ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    p_abort.check();
+}
+
+DWORD WINAPI matroska_info_batch::g_thread_proc(LPVOID p_param) {
+    g_run(*static_cast<context *>(p_param));
+    return 0;
+}
+
+void matroska_info_batch::g_run(context & p_context) {
+    for (;;) {
+        t_size index = static_cast<t_size>(InterlockedIncrement(&p_context.m_next) - 1);
+        if (index >= p_context.m_items->size() || p_context.m_abort->is_aborting()) {
+            break;
+        }
+        g_read_item(p_context.m_items->at(index), *p_context.m_abort);
+    }
+}
+
+void matroska_info_batch::g_read_item(item & p_item, abort_callback & p_abort) {
+    p_item.m_valid = false;
+    p_item.m_info.reset();
+    try {
+        service_ptr_t<input_info_reader> reader;
+        input_entry::g_open_for_info_read(reader, NULL, p_item.m_path, p_abort);
+        reader->get_info(p_item.m_subsong, p_item.m_info, p_abort);
+        p_item.m_stats = reader->get_file_stats(p_abort);
+        p_item.m_valid = true;
+    } catch (const std::exception &) {
+        // Left invalid, the other files go on
+    }
+}
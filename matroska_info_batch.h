@@ -0,0 +1,62 @@
+/*
+ *  Part of the foobar2000 Matroska plugin
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ *  WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*!
+    \file matroska_info_batch.h
+		\version $Id$
+    \brief Reading the info of many files at once
+*/
+
+#ifndef _MATROSKA_INFO_BATCH_H_
+#define _MATROSKA_INFO_BATCH_H_
+
+#include "../SDK/foobar2000.h"
+#include <vector>
+
+/// Reads the info of a list of files on several threads, so that the
+/// latency of each open overlaps with the others.
+/// Every file goes through its own info reader and parser, the threads
+/// take the next file to read from a shared counter.
+class matroska_info_batch {
+public:
+    struct item {
+        item() : m_subsong(0), m_stats(filestats_invalid), m_valid(false) {}
+
+        pfc::string8 m_path;
+        t_uint32 m_subsong;
+        file_info_impl m_info;
+        t_filestats m_stats;
+        /// false if the file could not be read
+        bool m_valid;
+    };
+
+    /// Most files read at the same time
+    static const t_size max_threads = 16;
+
+    /// Fills m_info, m_stats and m_valid of every item
+    /// \param p_threads Files read at the same time, 0 picks it from the processor count
+    static void g_read(std::vector<item> & p_items, abort_callback & p_abort, t_size p_threads = 0);
+
+private:
+    struct context {
+        std::vector<item> * m_items;
+        abort_callback * m_abort;
+        volatile LONG m_next;
+    };
+
+    static DWORD WINAPI g_thread_proc(LPVOID p_param);
+    static void g_run(context & p_context);
+    static void g_read_item(item & p_item, abort_callback & p_abort);
+};
+
+#endif // _MATROSKA_INFO_BATCH_H_
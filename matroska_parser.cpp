@@ -21,6 +21,8 @@
 */
 
 #include "matroska_parser.h"
+#include "matroska_header_cache.h"
+#include "matroska_index_cache.h"
 
 #include <string>
 using std::string;
@@ -96,6 +98,9 @@ MatroskaAudioFrame::MatroskaAudioFrame()
 {
 	timecode = 0;
 	duration = 0;
+	trackNo = 0;
+	keyframe = true;
+	laceCount = 0;
     add_id = 0;
 };
 
@@ -113,7 +118,99 @@ void MatroskaAudioFrame::Reset()
 {
 	timecode = 0;
 	duration = 0;
+	trackNo = 0;
+	keyframe = true;
+	laceCount = 0;
+	buffer = NULL;
     add_id = 0;
+	additional_data_buffer.clear();
+};
+
+void MatroskaAudioFrame::SetLaceCount(uint32 count)
+{
+	if (laces.size() < count)
+		laces.resize(count);
+	laceCount = count;
+};
+
+void MatroskaAudioFrame::Swap(MatroskaAudioFrame &other)
+{
+	std::swap(timecode, other.timecode);
+	std::swap(duration, other.duration);
+	std::swap(trackNo, other.trackNo);
+	std::swap(keyframe, other.keyframe);
+	std::swap(laceCount, other.laceCount);
+	buffer.swap(other.buffer);
+	laces.swap(other.laces);
+	std::swap(add_id, other.add_id);
+	additional_data_buffer.swap(other.additional_data_buffer);
+};
+
+MatroskaFrameRing::MatroskaFrameRing(uint32 size)
+	: m_Frames(size)
+{
+	assert((size & (size - 1)) == 0);
+	m_Mask = size - 1;
+	m_Write = 0;
+	m_Free = 0;
+	m_Read = 0;
+	m_Held = 0;
+};
+
+MatroskaAudioFrame *MatroskaFrameRing::GetWriteFrame()
+{
+	if (static_cast<uint32>(m_Write - m_Free) > m_Mask)
+		return NULL;
+	return &m_Frames[m_Write & m_Mask];
+};
+
+void MatroskaFrameRing::Commit()
+{
+	// The interlocked write keeps the frame contents ahead of the index
+	InterlockedExchange(&m_Write, m_Write + 1);
+};
+
+MatroskaAudioFrame *MatroskaFrameRing::Take()
+{
+	if (m_Read == m_Write)
+		return NULL;
+	MatroskaAudioFrame *frame = &m_Frames[m_Read & m_Mask];
+	m_Read++;
+	m_Held++;
+	return frame;
+};
+
+bool MatroskaFrameRing::TakeInto(MatroskaAudioFrame &frame)
+{
+	if (m_Read == m_Write)
+		return false;
+	frame.Swap(m_Frames[m_Read & m_Mask]);
+	m_Read++;
+	Publish();
+	return true;
+};
+
+void MatroskaFrameRing::Release(MatroskaAudioFrame *frame)
+{
+	// Let go of the cluster buffer now rather than when the frame is reused
+	frame->Reset();
+	m_Held--;
+	if (m_Held == 0)
+		Publish();
+	else
+		InterlockedExchange(&m_Free, m_Free + 1);
+};
+
+void MatroskaFrameRing::Flush()
+{
+	m_Read = m_Write;
+	Publish();
+};
+
+void MatroskaFrameRing::Publish()
+{
+	if (m_Held == 0)
+		InterlockedExchange(&m_Free, m_Read);
 };
 
 MatroskaSimpleTag::MatroskaSimpleTag()
@@ -181,6 +278,69 @@ void MatroskaTagInfo::MarkAllAsRemovalPending()
 	}
 }
 
+MatroskaCuePoint::MatroskaCuePoint()
+{
+	timecode = 0;
+	clusterPos = 0;
+	relativePos = 0;
+	blockNumber = 0;
+	track = 0;
+};
+
+size_t MatroskaClusterIndex::LowerBound(uint64 filePos) const
+{
+	return std::lower_bound(m_Positions.begin(), m_Positions.end(), filePos) - m_Positions.begin();
+}
+
+size_t MatroskaClusterIndex::Find(uint64 filePos) const
+{
+	size_t c = LowerBound(filePos);
+	if (c < m_Positions.size() && m_Positions[c] == filePos)
+		return c;
+	return CLUSTER_NOT_FOUND;
+}
+
+size_t MatroskaClusterIndex::Insert(uint64 filePos, uint64 timecode)
+{
+	size_t c = LowerBound(filePos);
+	if (c < m_Positions.size() && m_Positions[c] == filePos) {
+		if (m_Timecodes[c] == MAX_UINT64)
+			m_Timecodes[c] = timecode;
+		return c;
+	}
+	m_Positions.insert(m_Positions.begin() + c, filePos);
+	m_Timecodes.insert(m_Timecodes.begin() + c, timecode);
+	return c;
+}
+
+typedef std::pair<uint64, uint64> ClusterPosTimecode;
+
+static bool ClusterPosLess(const ClusterPosTimecode &entry1, const ClusterPosTimecode &entry2)
+{
+	return entry1.first < entry2.first;
+}
+
+void MatroskaClusterIndex::Sort()
+{
+	std::vector<ClusterPosTimecode> entries(m_Positions.size());
+	for (size_t c = 0; c < m_Positions.size(); c++)
+		entries[c] = ClusterPosTimecode(m_Positions[c], m_Timecodes[c]);
+	std::stable_sort(entries.begin(), entries.end(), ClusterPosLess);
+
+	// Drop duplicate positions, keeping the entry with a known timecode
+	m_Positions.clear();
+	m_Timecodes.clear();
+	for (size_t c = 0; c < entries.size(); c++) {
+		if (!m_Positions.empty() && m_Positions.back() == entries[c].first) {
+			if (m_Timecodes.back() == MAX_UINT64)
+				m_Timecodes.back() = entries[c].second;
+		} else {
+			m_Positions.push_back(entries[c].first);
+			m_Timecodes.push_back(entries[c].second);
+		}
+	}
+}
+
 MatroskaChapterDisplayInfo::MatroskaChapterDisplayInfo()  {
 	string = L"";
 };
@@ -206,20 +366,78 @@ MatroskaTrackInfo::MatroskaTrackInfo() {
 	bitsPerSample = 0;
 	avgBytesPerSec = 0;
 	defaultDuration = 0;
+	compressionAlgo = MATROSKA_COMPRESSION_NONE;
 
 	name = L"";
 
 	codecPrivateReady = false;
 };
 
-MatroskaAudioParser::MatroskaAudioParser(service_ptr_t<file> input, abort_callback & p_abort) 
-	: m_IOCallback(input, p_abort),
-		m_InputStream(m_IOCallback)
+MatroskaHeaderInfo::MatroskaHeaderInfo()
+{
+	indexed = false;
+	dataPos = 0;
+	audioOnly = true;
+	cuesPos = 0;
+	clusterScanPos = 0;
+	clusterScanTimecode = 0;
+	clusterScanDone = false;
+	segmentEnd = 0;
+	duration = 0;
+	timecodeScale = TIMECODE_SCALE;
+	fileDate = 0;
+	tagPos = 0;
+	tagSize = 0;
+};
+
+size_t MatroskaHeaderInfo::GetMemorySize() const
+{
+	size_t size = sizeof(MatroskaHeaderInfo);
+	for (size_t t = 0; t < tracks.size(); t++)
+		size += sizeof(MatroskaTrackInfo) + tracks.at(t).codecPrivate.size() + tracks.at(t).compressionSettings.size();
+	size += editions.size() * sizeof(MatroskaEditionInfo);
+	// Chapters and tags are mostly short strings
+	size += chapters.size() * (sizeof(MatroskaChapterInfo) + 128);
+	for (size_t t = 0; t < tags.size(); t++)
+		size += sizeof(MatroskaTagInfo) + tags.at(t).tags.size() * (sizeof(MatroskaSimpleTag) + 128);
+	size += attachments.get_count() * (sizeof(MatroskaAttachment) + 128);
+	size += clusters.GetMemorySize();
+	size += cues.size() * sizeof(MatroskaCuePoint);
+	return size;
+}
+
+static Foobar2000ReaderIOCallback *CreateIOCallback(service_ptr_t<file> input, abort_callback & p_abort, const char *path)
+{
+	pfc::string8 nativePath;
+	if (input->can_seek() && !input->is_remote() && MappedFileIOCallback::GetLocalPath(path, nativePath)) {
+		MappedFileIOCallback *callback = new MappedFileIOCallback(input, p_abort, nativePath);
+		if (callback->IsMapped())
+			return callback;
+		delete callback;
+	}
+	return new Foobar2000ReaderIOCallback(input, p_abort);
+}
+
+/// Frames the prefetch thread can parse ahead of the decoder
+#define FRAME_RING_SIZE 256
+/// Largest element header or small element looked at before it is read from a stream
+#define STREAM_LOOKAHEAD_SIZE (64 * 1024)
+
+MatroskaAudioParser::MatroskaAudioParser(service_ptr_t<file> input, abort_callback & p_abort, const char *path) 
+	: m_IOCallbackPtr(CreateIOCallback(input, p_abort, path)),
+		m_IOCallback(*m_IOCallbackPtr),
+		m_InputStream(m_IOCallback),
+		m_StreamReader(m_IOCallback, STREAM_LOOKAHEAD_SIZE),
+		m_FrameRing(FRAME_RING_SIZE)
 {
 	m_TimecodeScale = TIMECODE_SCALE;
 	m_FileDate = 0;
 	m_Duration = 0;
 	m_CurrentTimecode = 0;
+	m_SeekTimecode = MAX_UINT64;
+	m_SeekClusterPos = 0;
+	m_SeekBlockOffset = 0;
+	m_SeekRepeat = false;
 	//m_ElementLevel0 = NULL;
 	//UpperElementLevel = 0;
 	m_CurrentEdition = 0;
@@ -229,9 +447,48 @@ MatroskaAudioParser::MatroskaAudioParser(service_ptr_t<file> input, abort_callba
 	m_TagSize = 0;
 	m_TagScanRange = 1024 * 64;
 	m_CurrentTrackNo = 0;
+	m_CuesPos = 0;
+	m_SeekInfoPos = 0;
+	m_SeekTracksPos = 0;
+	m_SeekChaptersPos = 0;
+	m_SeekTagsPos = 0;
+	m_SeekAttachmentsPos = 0;
+	m_ClusterScanPos = 0;
+	m_ClusterScanTimecode = 0;
+	m_ClusterScanDone = false;
+	m_SegmentEnd = m_FileSize;
+	m_CacheStats = filestats_invalid;
+	m_IndexCacheReady = false;
+	m_IndexCacheResolved = 0;
+	m_IndexCacheScanPos = 0;
+	m_FollowMode = false;
+	m_FramePoolMisses = 0;
+	m_ClusterBufferMisses = 0;
+	m_AudioOnly = true;
+	m_PrefetchEnabled = false;
+	m_PrefetchThread = NULL;
+	m_PrefetchReadyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_PrefetchFreeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_PrefetchWaiting = 0;
+	m_PrefetchStop = false;
+	m_PrefetchDone = false;
+	m_InflateReady = false;
+	m_StreamInCluster = false;
+	m_StreamClusterEnd = MAX_UINT64;
+	m_StreamClusterTimecode = 0;
 };
 
 MatroskaAudioParser::~MatroskaAudioParser() {
+	StopPrefetch(false);
+	CloseHandle(m_PrefetchReadyEvent);
+	CloseHandle(m_PrefetchFreeEvent);
+
+	try {
+		SaveIndexCache();
+	} catch (...) {
+		// The cache is only an optimization
+	}
+
 	//if (m_ElementLevel0 != NULL)
 	//	_DELETE(m_ElementLevel0);
 		//delete m_ElementLevel0;
@@ -242,8 +499,18 @@ MatroskaAudioParser::~MatroskaAudioParser() {
 		_DELETE(currentPacket);
 		m_Queue.pop();
 	}
+	for (size_t f = 0; f < m_FramePool.size(); f++)
+		delete m_FramePool.at(f);
+	if (m_InflateReady)
+		inflateEnd(&m_InflateStream);
+	NOTE2("MatroskaAudioParser::~MatroskaAudioParser() %u frame pool misses, %u cluster buffer misses", m_FramePoolMisses, m_ClusterBufferMisses);
+	NOTE3("MatroskaAudioParser::~MatroskaAudioParser() read-ahead %u hits, %u misses, %u direct reads",
+		(uint32)m_IOCallback.GetHits(), (uint32)m_IOCallback.GetMisses(), (uint32)m_IOCallback.GetDirectReads());
 };
 
+/// Furthest from the end of the file that ScanForElement() looks for Tags the SeekHead lists
+#define TAG_SCAN_MAX_RANGE (1024 * 1024)
+
 int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters) 
 {
 	try {
@@ -256,6 +523,8 @@ int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters)
 		ElementPtr ElementLevel4;
 		ElementPtr ElementLevel5;
 		ElementPtr NullElement;
+		// The info was read from the SeekHead entries, the level 1 walk can stop
+		bool bSeekTargetsRead = false;
 
 		// Be sure we are at the beginning of the file
 		m_IOCallback.setFilePointer(0);
@@ -281,6 +550,23 @@ int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters)
 			//_DELETE(m_ElementLevel0);
 			return 1;
 		}
+		{
+			uint64 segmentDataPos = m_ElementLevel0->GetElementPosition() + m_ElementLevel0->HeadSize();
+			// Unknown sized or truncated segments end with the file
+			m_SegmentEnd = m_FileSize;
+			if (m_ElementLevel0->IsFiniteSize() && (segmentDataPos <= m_FileSize) && (m_ElementLevel0->GetSize() < m_FileSize - segmentDataPos))
+				m_SegmentEnd = segmentDataPos + m_ElementLevel0->GetSize();
+		}
+
+		if (!m_CachePath.is_empty() && m_IOCallback.seekable()) {
+			// Another service may have parsed this file already
+			matroska_header_cache::header_ptr cached = matroska_header_cache::g_find(m_CachePath, m_CacheStats, !bInfoOnly);
+			if (cached.get() != NULL) {
+				ImportHeader(*cached);
+				m_IOCallback.setFilePointer(cached->dataPos);
+				return 0;
+			}
+		}
 
 		UpperElementLevel = 0;
 		// We've got our segment, so let's find the tracks
@@ -296,260 +582,51 @@ int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters)
 			if (EbmlId(*ElementLevel1) == KaxSeekHead::ClassInfos.GlobalId) {
 				if (m_IOCallback.seekable()) {
 					Parse_MetaSeek(ElementLevel1, bInfoOnly);
+					if (bInfoOnly && (m_SeekInfoPos != 0) && (m_SeekTracksPos != 0)) {
+						// Read what the SeekHead lists first
+						Parse_SeekTargets();
+						// Chapters or attachments it doesn't list can still sit before the first cluster
+						bSeekTargetsRead = (m_SeekChaptersPos != 0) && (m_SeekAttachmentsPos != 0);
+					}
 					if (m_TagPos == 0) {
-						// Search for them at the end of the file
-						if (m_TagScanRange > 0)
-						{
-							m_IOCallback.setFilePointer(m_FileSize - m_TagScanRange);
-							uint64 init_pos = m_IOCallback.getFilePointer();
-							/*
-								BM Search
-							*/
-							binary buf[1024*64];
-							binary pat[3]; pat[0] = 0x54; pat[1] = 0xc3; pat[2] = 0x67;
-							uint64 s_pos = m_IOCallback.getFilePointer();
-							m_IOCallback.read(buf, m_TagScanRange);
-							MatroskaSearch search(buf, pat);
-							int pos = search.Match();
-							if (pos != -1) {
-								do {
-									m_IOCallback.setFilePointer(s_pos+pos+3);
-									uint64 startPos = m_IOCallback.getFilePointer();
-									m_IOCallback.setFilePointer(-4, seek_current);
-									ElementPtr levelUnknown = ElementPtr(m_InputStream.FindNextID(KaxTags::ClassInfos, 0xFFFFFFFFFFFFFFFFL));
-									if ((levelUnknown != NullElement) 
-										&& (m_FileSize >= startPos + levelUnknown->GetSize()) 
-										&& (EbmlId(*levelUnknown) == KaxTags::ClassInfos.GlobalId))
-									{
-										Parse_Tags(static_cast<KaxTags *>(levelUnknown.get()));
-										break;
-									}
-									m_IOCallback.setFilePointer(s_pos);
-									pos = search.Match(pos+1);
-								} while (pos != -1);
-								/*
-									~BM Search
-								*/
-							} else {
-								m_IOCallback.setFilePointer(init_pos);
-								binary Buffer[4];
-								while (m_IOCallback.read(Buffer, 3) >= 3)
-								{//0x18
-									if ((Buffer[0] == 0x54) && (Buffer[1] == 0xc3) && (Buffer[2] == 0x67))
-									{
-										uint64 startPos = m_IOCallback.getFilePointer();
-
-										//seek back 3 bytes, so libmatroska can find the Tags element Ebml ID
-										m_IOCallback.setFilePointer(-4, seek_current);
-
-										ElementPtr levelUnknown = ElementPtr(m_InputStream.FindNextID(KaxTags::ClassInfos, 0xFFFFFFFFFFFFFFFFL));
-										if ((levelUnknown != NullElement) 
-											&& (m_FileSize >= startPos + levelUnknown->GetSize()) 
-											&& (EbmlId(*levelUnknown) == KaxTags::ClassInfos.GlobalId))
-										{
-											Parse_Tags(static_cast<KaxTags *>(levelUnknown.get()));
-											//_DELETE(levelUnknown);
-											break;
-										}
-										//_DELETE(levelUnknown);
-
-										//Restore the file pos
-										m_IOCallback.setFilePointer(startPos);
-									}
-									//seek back 2 bytes
-									m_IOCallback.setFilePointer(-2, seek_current);
-								}
-							}
-						} else {
-							//m_TagPos = m_FileSize;
+						// Search for them at the end of the file, further if the SeekHead says there are some
+						uint64 tagsPos = ScanForElement(KaxTags::ClassInfos.GlobalId.Value, (m_SeekTagsPos != 0) ? TAG_SCAN_MAX_RANGE : m_TagScanRange);
+						if (tagsPos != 0) {
+							ElementPtr levelUnknown = FindElementAt(tagsPos, KaxTags::ClassInfos);
+							if ((levelUnknown != NullElement) && MarkElementParsed(*levelUnknown))
+								Parse_Tags(static_cast<KaxTags *>(levelUnknown.get()));
 						}
 					}
-				}
-			}else if (EbmlId(*ElementLevel1) == KaxInfo::ClassInfos.GlobalId) {
-				// General info about this Matroska file
-				ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, 0xFFFFFFFFFFFFFFFFL, bAllowDummy));
-				while (ElementLevel2 != NullElement) {
-					if (UpperElementLevel > 0) {
+					if (bSeekTargetsRead)
 						break;
-					}
-					if (UpperElementLevel < 0) {
-						UpperElementLevel = 0;
-					}
-
-					if (EbmlId(*ElementLevel2) == KaxTimecodeScale::ClassInfos.GlobalId) {
-						KaxTimecodeScale &TimeScale = *static_cast<KaxTimecodeScale *>(ElementLevel2.get());
-						TimeScale.ReadData(m_InputStream.I_O());
-
-						//matroskaGlobalTrack->SetTimecodeScale(uint64(TimeScale));
-						m_TimecodeScale = uint64(TimeScale);
-					} else if (EbmlId(*ElementLevel2) == KaxDuration::ClassInfos.GlobalId) {
-						KaxDuration &duration = *static_cast<KaxDuration *>(ElementLevel2.get());
-						duration.ReadData(m_InputStream.I_O());
-
-						// it's in milliseconds? -- in nanoseconds.
-						m_Duration = double(duration) * m_TimecodeScale;
-
-					} else if (EbmlId(*ElementLevel2) == KaxDateUTC::ClassInfos.GlobalId) {
-						KaxDateUTC & DateUTC = *static_cast<KaxDateUTC *>(ElementLevel2.get());
-						DateUTC.ReadData(m_InputStream.I_O());
-						
-						m_FileDate = DateUTC.GetEpochDate();
-
-					} else if (EbmlId(*ElementLevel2) == KaxSegmentFilename::ClassInfos.GlobalId) {
-						KaxSegmentFilename &tag_SegmentFilename = *static_cast<KaxSegmentFilename *>(ElementLevel2.get());
-						tag_SegmentFilename.ReadData(m_InputStream.I_O());
-
-						m_SegmentFilename = *static_cast<EbmlUnicodeString *>(&tag_SegmentFilename);
-
-					} else if (EbmlId(*ElementLevel2) == KaxMuxingApp::ClassInfos.GlobalId)	{
-						KaxMuxingApp &tag_MuxingApp = *static_cast<KaxMuxingApp *>(ElementLevel2.get());
-						tag_MuxingApp.ReadData(m_InputStream.I_O());
-
-						m_MuxingApp = *static_cast<EbmlUnicodeString *>(&tag_MuxingApp);
-
-					} else if (EbmlId(*ElementLevel2) == KaxWritingApp::ClassInfos.GlobalId) {
-						KaxWritingApp &tag_WritingApp = *static_cast<KaxWritingApp *>(ElementLevel2.get());
-						tag_WritingApp.ReadData(m_InputStream.I_O());
-						
-						m_WritingApp = *static_cast<EbmlUnicodeString *>(&tag_WritingApp);
-
-					} else if (EbmlId(*ElementLevel2) == KaxTitle::ClassInfos.GlobalId) {
-						KaxTitle &Title = *static_cast<KaxTitle*>(ElementLevel2.get());
-						Title.ReadData(m_InputStream.I_O());
-						m_FileTitle = UTFstring(Title).c_str();
-					}
-
-					if (UpperElementLevel > 0) {	// we're coming from ElementLevel3
-						UpperElementLevel--;
-						//delete ElementLevel2;
-						ElementLevel2 = ElementLevel3;
-						if (UpperElementLevel > 0)
-							break;
-					} else {
-						ElementLevel2->SkipData(m_InputStream, ElementLevel2->Generic().Context);
-						//delete ElementLevel2;
-						//_DELETE(ElementLevel2);
-						ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, 0xFFFFFFFFFFFFFFFFL, bAllowDummy));
-					}
 				}
+			}else if (EbmlId(*ElementLevel1) == KaxInfo::ClassInfos.GlobalId) {
+				if (MarkElementParsed(*ElementLevel1))
+					Parse_Info(static_cast<KaxInfo *>(ElementLevel1.get()));
+			}else if (EbmlId(*ElementLevel1) == KaxCues::ClassInfos.GlobalId) {
+				// Read once the header is done, the cue times need the TimecodeScale
+				if (m_CuesPos == 0)
+					m_CuesPos = ElementLevel1->GetElementPosition();
 			}else if (EbmlId(*ElementLevel1) == KaxChapters::ClassInfos.GlobalId) {
-				Parse_Chapters(static_cast<KaxChapters *>(ElementLevel1.get()));
+				if (MarkElementParsed(*ElementLevel1))
+					Parse_Chapters(static_cast<KaxChapters *>(ElementLevel1.get()));
 			}else if (EbmlId(*ElementLevel1) == KaxTags::ClassInfos.GlobalId) {
-				Parse_Tags(static_cast<KaxTags *>(ElementLevel1.get()));
+				if (MarkElementParsed(*ElementLevel1))
+					Parse_Tags(static_cast<KaxTags *>(ElementLevel1.get()));
 			} else if (EbmlId(*ElementLevel1) == KaxTracks::ClassInfos.GlobalId) {
-				// Yep, we've found our KaxTracks element. Now find all tracks
-				// contained in this segment. 
-				KaxTracks *Tracks = static_cast<KaxTracks *>(ElementLevel1.get());
-				EbmlElement* tmpElement = ElementLevel2.get();
-				Tracks->Read(m_InputStream, KaxTracks::ClassInfos.Context, UpperElementLevel, tmpElement, bAllowDummy);
-
-				unsigned int Index0;
-				for (Index0 = 0; Index0 < Tracks->ListSize(); Index0++) {
-					if ((*Tracks)[Index0]->Generic().GlobalId == KaxTrackEntry::ClassInfos.GlobalId) {
-						KaxTrackEntry &TrackEntry = *static_cast<KaxTrackEntry *>((*Tracks)[Index0]);
-						// Create a new MatroskaTrack
-						MatroskaTrackInfo newTrack;
-						
-						unsigned int Index1;
-						for (Index1 = 0; Index1 < TrackEntry.ListSize(); Index1++) {
-							if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackNumber::ClassInfos.GlobalId) {
-								KaxTrackNumber &TrackNumber = *static_cast<KaxTrackNumber*>(TrackEntry[Index1]);
-								newTrack.trackNumber = TrackNumber;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackUID::ClassInfos.GlobalId) {
-								KaxTrackUID &TrackUID = *static_cast<KaxTrackUID*>(TrackEntry[Index1]);
-								newTrack.trackUID = TrackUID;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackType::ClassInfos.GlobalId) {
-								KaxTrackType &TrackType = *static_cast<KaxTrackType*>(TrackEntry[Index1]);
-								if (uint8(TrackType) != track_audio) {
-									newTrack.trackNumber = 0xFFFF;
-									break;
-								}
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackTimecodeScale::ClassInfos.GlobalId) {
-								KaxTrackTimecodeScale &TrackTimecodeScale = *static_cast<KaxTrackTimecodeScale*>(TrackEntry[Index1]);
-								// TODO: Support Tracks with different timecode scales?
-								//newTrack->TrackTimecodeScale = TrackTimecodeScale;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackDefaultDuration::ClassInfos.GlobalId) {
-								KaxTrackDefaultDuration &TrackDefaultDuration = *static_cast<KaxTrackDefaultDuration*>(TrackEntry[Index1]);
-								newTrack.defaultDuration = uint64(TrackDefaultDuration);
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxCodecID::ClassInfos.GlobalId) {
-								KaxCodecID &CodecID = *static_cast<KaxCodecID*>(TrackEntry[Index1]);
-								newTrack.codecID = std::string(CodecID);
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxCodecPrivate::ClassInfos.GlobalId) {
-								KaxCodecPrivate &CodecPrivate = *static_cast<KaxCodecPrivate*>(TrackEntry[Index1]);
-								newTrack.codecPrivate.resize(CodecPrivate.GetSize());								
-								memcpy(&newTrack.codecPrivate[0], CodecPrivate.GetBuffer(), CodecPrivate.GetSize());
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackFlagDefault::ClassInfos.GlobalId) {
-								KaxTrackFlagDefault &TrackFlagDefault = *static_cast<KaxTrackFlagDefault*>(TrackEntry[Index1]);
-								//newTrack->FlagDefault = TrackFlagDefault;
-							/* Matroska2
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackFlagEnabled::ClassInfos.GlobalId) {
-								KaxTrackFlagEnabled &TrackFlagEnabled = *static_cast<KaxTrackFlagEnabled*>(TrackEntry[Index1]);
-								//newTrack->FlagEnabled = TrackFlagEnabled;
-							*/
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackFlagLacing::ClassInfos.GlobalId) {
-								KaxTrackFlagLacing &TrackFlagLacing = *static_cast<KaxTrackFlagLacing*>(TrackEntry[Index1]);
-								//newTrack->FlagLacing = TrackFlagLacing;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackLanguage::ClassInfos.GlobalId) {
-								KaxTrackLanguage &TrackLanguage = *static_cast<KaxTrackLanguage*>(TrackEntry[Index1]);
-								newTrack.language = std::string(TrackLanguage);
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackMaxCache::ClassInfos.GlobalId) {
-								KaxTrackMaxCache &TrackMaxCache = *static_cast<KaxTrackMaxCache*>(TrackEntry[Index1]);
-								//newTrack->MaxCache = TrackMaxCache;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackMinCache::ClassInfos.GlobalId) {
-								KaxTrackMinCache &TrackMinCache = *static_cast<KaxTrackMinCache*>(TrackEntry[Index1]);
-								//newTrack->MinCache = TrackMinCache;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackName::ClassInfos.GlobalId) {
-								KaxTrackName &TrackName = *static_cast<KaxTrackName*>(TrackEntry[Index1]);
-								newTrack.name = TrackName;
-
-							} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackAudio::ClassInfos.GlobalId) {
-								KaxTrackAudio &TrackAudio = *static_cast<KaxTrackAudio*>(TrackEntry[Index1]);
-
-								unsigned int Index2;
-								for (Index2 = 0; Index2 < TrackAudio.ListSize(); Index2++) {
-									if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioBitDepth::ClassInfos.GlobalId) {
-										KaxAudioBitDepth &AudioBitDepth = *static_cast<KaxAudioBitDepth*>(TrackAudio[Index2]);
-										newTrack.bitsPerSample = AudioBitDepth;
-									/* Matroska2
-									} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioPosition::ClassInfos.GlobalId) {
-										KaxAudioPosition &AudioPosition = *static_cast<KaxAudioPosition*>(TrackAudio[Index2]);
-
-										// TODO: Support multi-channel?
-										//newTrack->audio->ChannelPositionSize = AudioPosition.GetSize();
-										//newTrack->audio->ChannelPosition = new binary[AudioPosition.GetSize()+1];
-										//memcpy(newTrack->audio->ChannelPosition, AudioPosition.GetBuffer(), AudioPosition.GetSize());
-									*/
-									} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioChannels::ClassInfos.GlobalId) {
-										KaxAudioChannels &AudioChannels = *static_cast<KaxAudioChannels*>(TrackAudio[Index2]);
-										newTrack.channels = AudioChannels;
-
-									} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioOutputSamplingFreq::ClassInfos.GlobalId) {
-										KaxAudioOutputSamplingFreq &AudioOutputSamplingFreq = *static_cast<KaxAudioOutputSamplingFreq*>(TrackAudio[Index2]);
-										newTrack.samplesOutputPerSec = AudioOutputSamplingFreq;
-
-									} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioSamplingFreq::ClassInfos.GlobalId) {
-										KaxAudioSamplingFreq &AudioSamplingFreq = *static_cast<KaxAudioSamplingFreq*>(TrackAudio[Index2]);
-										newTrack.samplesPerSec = AudioSamplingFreq;
-									}
-								}
-							}
-						}
-						if (newTrack.trackNumber != 0xFFFF)
-							m_Tracks.push_back(newTrack);
-					}
-				}
+				if (MarkElementParsed(*ElementLevel1))
+					Parse_Tracks(static_cast<KaxTracks *>(ElementLevel1.get()));
 			} else if (EbmlId(*ElementLevel1) == KaxCluster::ClassInfos.GlobalId) {
+				if (m_ClusterScanPos == 0)
+					m_ClusterScanPos = ElementLevel1->GetElementPosition();
+				if (bBreakAtClusters && !m_IOCallback.seekable()) {
+					// The cluster header can't be read again, the stream is picked up inside the cluster
+					m_StreamInCluster = true;
+					m_StreamClusterEnd = MAX_UINT64;
+					if (ElementLevel1->IsFiniteSize())
+						m_StreamClusterEnd = m_IOCallback.getFilePointer() + ElementLevel1->GetSize();
+					break;
+				}
 				if (bBreakAtClusters) {
 					m_IOCallback.setFilePointer(ElementLevel1->GetElementPosition());
 					//delete ElementLevel1;
@@ -558,83 +635,8 @@ int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters)
 					break;
 				}
 			} else if (EbmlId(*ElementLevel1) == KaxAttachments::ClassInfos.GlobalId) {
-				// Yep, we've found our KaxAttachment element. Now find all attached files
-				// contained in this segment.
-#if 1
-				ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
-				while (ElementLevel2 != NullElement) {
-					if (UpperElementLevel > 0) {
-						break;
-					}
-					if (UpperElementLevel < 0) {
-						UpperElementLevel = 0;
-					}
-					if (EbmlId(*ElementLevel2) == KaxAttached::ClassInfos.GlobalId) {
-						// We actually found a attached file entry :D
-						MatroskaAttachment newAttachment;
-
-						ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
-						while (ElementLevel3 != NullElement) {
-							if (UpperElementLevel > 0) {
-								break;
-							}
-							if (UpperElementLevel < 0) {
-								UpperElementLevel = 0;
-							}
-
-							// Now evaluate the data belonging to this track
-							if (EbmlId(*ElementLevel3) == KaxFileName::ClassInfos.GlobalId) {
-								KaxFileName &attached_filename = *static_cast<KaxFileName *>(ElementLevel3.get());
-								attached_filename.ReadData(m_InputStream.I_O());
-								newAttachment.FileName = UTFstring(attached_filename);
-
-							} else if (EbmlId(*ElementLevel3) == KaxMimeType::ClassInfos.GlobalId) {
-								KaxMimeType &attached_mime_type = *static_cast<KaxMimeType *>(ElementLevel3.get());
-								attached_mime_type.ReadData(m_InputStream.I_O());
-								newAttachment.MimeType = std::string(attached_mime_type);
-
-							} else if (EbmlId(*ElementLevel3) == KaxFileDescription::ClassInfos.GlobalId) {
-								KaxFileDescription &attached_description = *static_cast<KaxFileDescription *>(ElementLevel3.get());
-								attached_description.ReadData(m_InputStream.I_O());
-								newAttachment.Description = UTFstring(attached_description);
-
-							} else if (EbmlId(*ElementLevel3) == KaxFileData::ClassInfos.GlobalId) {
-								KaxFileData &attached_data = *static_cast<KaxFileData *>(ElementLevel3.get());
-
-								//We don't what to read the data into memory because it could be very large
-								//attached_data.ReadData(m_InputStream.I_O());
-
-								//Instead we store the Matroska filename, the start of the data and the length, so we can read it
-								//later at the users request. IMHO This will save a lot of memory
-								newAttachment.SourceStartPos = attached_data.GetElementPosition() + attached_data.HeadSize();
-								newAttachment.SourceDataLength = attached_data.GetSize();
-							}
-
-							if (UpperElementLevel > 0) {	// we're coming from ElementLevel4
-								UpperElementLevel--;
-								ElementLevel3 = ElementLevel4;
-								if (UpperElementLevel > 0)
-									break;
-							} else {
-								ElementLevel3->SkipData(m_InputStream, ElementLevel3->Generic().Context);
-								ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
-							}					
-						} // while (ElementLevel3 != NULL)
-						//m_AttachmentList.push_back(newAttachment);
-                        m_AttachmentList.add_item(newAttachment);
-					}
-
-					if (UpperElementLevel > 0) {	// we're coming from ElementLevel3
-						UpperElementLevel--;
-						ElementLevel2 = ElementLevel3;
-						if (UpperElementLevel > 0)
-							break;
-					} else {
-						ElementLevel2->SkipData(m_InputStream, ElementLevel2->Generic().Context);
-						ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
-					}
-				} // while (ElementLevel2 != NULL)
-#endif
+				if (MarkElementParsed(*ElementLevel1))
+					Parse_Attachments(static_cast<KaxAttachments *>(ElementLevel1.get()));
 			}
 			
 			if (UpperElementLevel > 0) {		// we're coming from ElementLevel2
@@ -656,6 +658,62 @@ int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters)
 		//_DELETE(ElementLevel3);
 		//_DELETE(ElementLevel2);
 		//_DELETE(ElementLevel1);
+
+		uint64 dataPos = m_IOCallback.getFilePointer();
+		if (!m_IOCallback.seekable())
+			m_StreamReader.Reset(dataPos);
+		bool bIndexCached = false;
+		if (!bInfoOnly && m_IOCallback.seekable()) {
+			bIndexCached = LoadIndexCache();
+			m_IndexCacheReady = true;
+		}
+
+		if (!bInfoOnly && !bIndexCached && (m_CuesPos != 0) && m_IOCallback.seekable()) {
+			uint64 resumePos = m_IOCallback.getFilePointer();
+			try {
+				m_IOCallback.setFilePointer(m_CuesPos);
+				ElementPtr levelUnknown = ElementPtr(m_InputStream.FindNextID(KaxCues::ClassInfos, 0xFFFFFFFFFFFFFFFFL));
+				if ((levelUnknown != NullElement) 
+					&& (EbmlId(*levelUnknown) == KaxCues::ClassInfos.GlobalId))
+				{
+					Parse_Cues(static_cast<KaxCues *>(levelUnknown.get()));
+				}
+			} catch (...) {
+				// Broken cues only cost us the fast seeking
+				m_CueIndex.clear();
+			}
+			m_IOCallback.setFilePointer(resumePos);
+		}
+
+		if (!bInfoOnly && !bIndexCached && m_IOCallback.seekable()) {
+			// Playback can start once the first cluster is indexed, the scan goes
+			// on when seeking or playing needs more of the index
+			m_ClusterIndex.Sort();
+			ExtendClusterIndex(0, 1);
+		}
+
+		if ((m_Duration == 0) && m_IOCallback.seekable()) {
+			// Without a Duration in the Info, the end of the last block gives it
+			if (bInfoOnly)
+				LoadCachedDuration();
+			if (m_Duration == 0) {
+				uint64 resumePos = m_IOCallback.getFilePointer();
+				m_Duration = static_cast<double>(ScanDuration());
+				m_IOCallback.setFilePointer(resumePos);
+				if (bInfoOnly)
+					SaveCachedDuration();
+			}
+		}
+
+		if (!m_CachePath.is_empty() && m_IOCallback.seekable()) {
+			m_ClusterIndex.Sort();
+			boost::shared_ptr<MatroskaHeaderInfo> header(new MatroskaHeaderInfo());
+			ExportHeader(*header);
+			header->indexed = !bInfoOnly;
+			header->dataPos = dataPos;
+			matroska_header_cache::g_add(m_CachePath, m_CacheStats, header);
+			m_IOCallback.setFilePointer(dataPos);
+		}
 	} catch (std::exception &) {
 		return 1;
 
@@ -663,13 +721,182 @@ int MatroskaAudioParser::Parse(bool bInfoOnly, bool bBreakAtClusters)
 		return 1;
 	}
 
-	CountClusters();
+	m_ClusterIndex.Sort();
 	return 0;
 };
 
+void MatroskaAudioParser::SetCacheKey(const char *path, const t_filestats &stats)
+{
+	m_CachePath = path;
+	m_CacheStats = stats;
+}
+
+bool MatroskaAudioParser::LoadIndexCache()
+{
+	if (m_CachePath.is_empty())
+		return false;
+
+	matroska_index_cache::view cached;
+	if (!matroska_index_cache::g_open(m_CachePath, m_CacheStats, cached))
+		return false;
+	if (m_Duration == 0)
+		m_Duration = static_cast<double>(cached.m_duration);
+	if (cached.m_cluster_count == 0)
+		// Only the duration was stored by an info read
+		return false;
+
+	// Straight from the mapped cache file
+	m_ClusterIndex.clear();
+	m_ClusterIndex.reserve(cached.m_cluster_count);
+	for (size_t c = 0; c < cached.m_cluster_count; c++)
+		m_ClusterIndex.Append(cached.m_clusters[c].m_position, cached.m_clusters[c].m_timecode);
+	m_CueIndex.resize(cached.m_cue_count);
+	for (size_t c = 0; c < cached.m_cue_count; c++) {
+		MatroskaCuePoint &cue = m_CueIndex.at(c);
+		cue.timecode = cached.m_cues[c].m_timecode;
+		cue.clusterPos = cached.m_cues[c].m_cluster_position;
+		cue.relativePos = cached.m_cues[c].m_relative_position;
+		cue.blockNumber = cached.m_cues[c].m_block_number;
+		cue.track = static_cast<uint16>(cached.m_cues[c].m_track);
+	}
+	m_ClusterScanPos = cached.m_scan_position;
+	m_ClusterScanTimecode = cached.m_scan_timecode;
+	m_ClusterScanDone = cached.m_scan_done;
+	m_ClusterIndex.Sort();
+
+	m_IndexCacheResolved = CountResolvedClusters();
+	m_IndexCacheScanPos = m_ClusterScanPos;
+	NOTE1("MatroskaAudioParser::LoadIndexCache() %u clusters from the index cache", (uint32)m_ClusterIndex.size());
+	return true;
+}
+
+void MatroskaAudioParser::SaveIndexCache()
+{
+	if (!m_IndexCacheReady || m_CachePath.is_empty() || m_ClusterIndex.empty())
+		return;
+
+	size_t resolved = CountResolvedClusters();
+	if ((m_IndexCacheResolved != 0) && (resolved == m_IndexCacheResolved) && (m_ClusterScanPos == m_IndexCacheScanPos))
+		return;
+
+	matroska_index_cache::data cached;
+	cached.m_clusters.resize(m_ClusterIndex.size());
+	for (size_t c = 0; c < m_ClusterIndex.size(); c++) {
+		cached.m_clusters.at(c).m_position = m_ClusterIndex.GetPosition(c);
+		cached.m_clusters.at(c).m_timecode = m_ClusterIndex.GetTimecode(c);
+	}
+	cached.m_cues = m_CueIndex;
+	cached.m_scan_position = m_ClusterScanPos;
+	cached.m_scan_timecode = m_ClusterScanTimecode;
+	cached.m_scan_done = m_ClusterScanDone;
+	cached.m_duration = static_cast<uint64>(m_Duration);
+	matroska_index_cache::g_store(m_CachePath, m_CacheStats, cached);
+}
+
+void MatroskaAudioParser::LoadCachedDuration()
+{
+	if (m_CachePath.is_empty())
+		return;
+	matroska_index_cache::view cached;
+	if (matroska_index_cache::g_open(m_CachePath, m_CacheStats, cached))
+		m_Duration = static_cast<double>(cached.m_duration);
+}
+
+void MatroskaAudioParser::SaveCachedDuration()
+{
+	if (m_CachePath.is_empty() || (m_Duration == 0))
+		return;
+	matroska_index_cache::data cached;
+	cached.m_scan_position = 0;
+	cached.m_scan_timecode = MAX_UINT64;
+	cached.m_scan_done = false;
+	cached.m_duration = static_cast<uint64>(m_Duration);
+	matroska_index_cache::g_store(m_CachePath, m_CacheStats, cached);
+}
+
+void MatroskaAudioParser::ExportHeader(MatroskaHeaderInfo &header)
+{
+	header.tracks = m_Tracks;
+	header.audioOnly = m_AudioOnly;
+	header.editions = m_Editions;
+	header.chapters = m_Chapters;
+	header.tags = m_Tags;
+	header.attachments = m_AttachmentList;
+
+	header.clusters = m_ClusterIndex;
+	header.cues = m_CueIndex;
+	header.cuesPos = m_CuesPos;
+	header.clusterScanPos = m_ClusterScanPos;
+	header.clusterScanTimecode = m_ClusterScanTimecode;
+	header.clusterScanDone = m_ClusterScanDone;
+	header.segmentEnd = m_SegmentEnd;
+
+	header.duration = m_Duration;
+	header.timecodeScale = m_TimecodeScale;
+	header.writingApp = m_WritingApp;
+	header.muxingApp = m_MuxingApp;
+	header.fileTitle = m_FileTitle;
+	header.fileDate = m_FileDate;
+	header.segmentFilename = m_SegmentFilename;
+	header.tagPos = m_TagPos;
+	header.tagSize = m_TagSize;
+}
+
+void MatroskaAudioParser::ImportHeader(const MatroskaHeaderInfo &header)
+{
+	m_Tracks = header.tracks;
+	m_AudioOnly = header.audioOnly;
+	m_Editions = header.editions;
+	m_Chapters = header.chapters;
+	m_Tags = header.tags;
+	m_AttachmentList = header.attachments;
+	m_CurrentEdition = NULL;
+	m_CurrentChapter = NULL;
+
+	// Each parser resolves timecodes in its own copy
+	m_ClusterIndex = header.clusters;
+	m_CueIndex = header.cues;
+	m_CuesPos = header.cuesPos;
+	m_ClusterScanPos = header.clusterScanPos;
+	m_ClusterScanTimecode = header.clusterScanTimecode;
+	m_ClusterScanDone = header.clusterScanDone;
+	m_SegmentEnd = header.segmentEnd;
+
+	m_Duration = header.duration;
+	m_TimecodeScale = header.timecodeScale;
+	m_WritingApp = header.writingApp;
+	m_MuxingApp = header.muxingApp;
+	m_FileTitle = header.fileTitle;
+	m_FileDate = header.fileDate;
+	m_SegmentFilename = header.segmentFilename;
+	m_TagPos = header.tagPos;
+	m_TagSize = header.tagSize;
+
+	if (header.indexed) {
+		// Only changes made from now on need to go to the index cache
+		m_IndexCacheReady = true;
+		m_IndexCacheResolved = CountResolvedClusters();
+		m_IndexCacheScanPos = m_ClusterScanPos;
+	}
+}
+
+size_t MatroskaAudioParser::CountResolvedClusters()
+{
+	size_t resolved = 0;
+	for (size_t c = 0; c < m_ClusterIndex.size(); c++) {
+		if (m_ClusterIndex.GetTimecode(c) != MAX_UINT64)
+			resolved++;
+	}
+	return resolved;
+}
+
 //int MatroskaAudioParser::WriteTags(const file_info & info)
 int MatroskaAudioParser::WriteTags()
 {
+	StopPrefetch();
+	if (!m_CachePath.is_empty())
+		matroska_header_cache::g_remove(m_CachePath);
+
 	KaxTags & MyKaxTags = GetChild<KaxTags>(*static_cast<EbmlMaster *>(m_ElementLevel0.get()));
 
 	// On to writing :)
@@ -1530,10 +1757,12 @@ void MatroskaAudioParser::MarkHiddenTags()
 
 void MatroskaAudioParser::SetCurrentTrack(uint32 newTrackNo)
 {
+	StopPrefetch(false);
 	m_CurrentTrackNo = newTrackNo;
 	// Clear the current queue (we are changing tracks)
-	while (!m_Queue.empty())
-		m_Queue.pop();
+	flush_queue();
+	// The block offsets only hold the blocks of the previous track
+	m_BlockOffsets.clear();
 };
 
 void MatroskaAudioParser::SetSubSong(int subsong)
@@ -1582,9 +1811,8 @@ bool MatroskaAudioParser::skip_frames_until(double destination,unsigned & frames
 				return true;
 			}
 			last_time = packet_time;
-			done += (last_laced = currentPacket->dataBuffer.size());
-			//delete currentPacket;
-			_DELETE(currentPacket);
+			done += (last_laced = currentPacket->GetLaceCount());
+			ReleaseFrame(currentPacket);
 			m_Queue.pop();
 		}
 		if (FillQueue()!=0)
@@ -1596,15 +1824,14 @@ bool MatroskaAudioParser::skip_frames_until(double destination,unsigned & frames
 void MatroskaAudioParser::flush_queue()
 {
 	while (!m_Queue.empty()) {
-		MatroskaAudioFrame *currentPacket = m_Queue.front();
-		//delete currentPacket;
-		_DELETE(currentPacket);
+		ReleaseFrame(m_Queue.front());
 		m_Queue.pop();
 	}
 }
 
 uint64 MatroskaAudioParser::get_current_frame_timecode()
 {
+	StopPrefetch();
 	if (m_Queue.empty())
 	{
 		if (FillQueue()!=0) return -1;
@@ -1623,20 +1850,33 @@ bool MatroskaAudioParser::Seek(double seconds,unsigned & frames_to_skip,double &
 
 	uint64 seekToTimecode = SecondsToTimecode(seconds);
 	
+	// Whatever was parsed ahead is of no use anymore
+	StopPrefetch(false);
 	flush_queue();
 	m_CurrentTimecode = seekToTimecode;
+	// Start at the block before the seek point when we know where it is in the cluster
+	m_SeekTimecode = seekToTimecode;
 
+	// The frames to skip are counted from the first frame of this fill
+	uint64 countStartTimecode = get_current_frame_timecode();
 	if (!skip_frames_until(seconds,frames_to_skip,time_to_skip,samplerate_hint)) return false;
 
 	flush_queue();
 	m_CurrentTimecode = seekToTimecode;
+	m_SeekTimecode = seekToTimecode;
+	// Block offsets recorded by the counting fill must not move the start
+	m_SeekRepeat = true;
 	if (FillQueue()!=0) return false;
+	if (!m_Queue.empty() && (m_Queue.front()->timecode != countStartTimecode))
+		NOTE2("MatroskaAudioParser::Seek() delivery starts at %u ms, skip counted from %u ms",
+			(uint32)(m_Queue.front()->timecode / 1000000), (uint32)(countStartTimecode / 1000000));
 	return true;
 
 };
 
 MatroskaAudioFrame * MatroskaAudioParser::ReadSingleFrame()
 {
+	StopPrefetch();
 	for(;;)
 	{
 		if (!m_Queue.empty()) {
@@ -1650,57 +1890,259 @@ MatroskaAudioFrame * MatroskaAudioParser::ReadSingleFrame()
 	}
 };
 
-MatroskaAudioFrame * MatroskaAudioParser::ReadFirstFrame()
-{
-    m_CurrentTimecode = 0;
-    return ReadSingleFrame();
-};
-
-typedef boost::shared_ptr<EbmlId> EbmlIdPtr;
+/// How often a followed file is checked for new clusters, in milliseconds
+#define FOLLOW_POLL_INTERVAL 500
 
-void MatroskaAudioParser::Parse_MetaSeek(ElementPtr metaSeekElement, bool bInfoOnly) 
+MatroskaAudioFrame * MatroskaAudioParser::ReadSingleFrame(abort_callback &p_abort)
 {
-    TIMER;
-	uint64 lastSeekPos = 0;
-	uint64 endSeekPos = 0;
-	ElementPtr l2;
-	ElementPtr l3;
-	ElementPtr NullElement;
-	int UpperElementLevel = 0;
+	if (m_FollowMode) {
+		// Waiting for the recorder is simpler without the prefetch thread
+		StopPrefetch();
+		for (;;) {
+			if (!m_Queue.empty()) {
+				MatroskaAudioFrame *newFrame = m_Queue.front();
+				m_Queue.pop();
+				return newFrame;
+			}
+			int ret = FillQueue();
+			if (ret == 3) {
+				WaitForSingleObject(p_abort.get_abort_event(), FOLLOW_POLL_INTERVAL);
+				p_abort.check();
+			} else if (ret != 0) {
+				return NULL;
+			}
+		}
+	}
 
-	if (metaSeekElement == NullElement)
-		return;
+	if (!m_PrefetchEnabled)
+		return ReadSingleFrame();
 
-	l2 = ElementPtr(m_InputStream.FindNextElement(metaSeekElement->Generic().Context, UpperElementLevel, 0xFFFFFFFFFFFFFFFFL, true, 1));
-	while (l2 != NullElement) {
-		if (UpperElementLevel > 0) {
-			break;
+	for(;;)
+	{
+		MatroskaAudioFrame *newFrame = m_FrameRing.Take();
+		if (newFrame != NULL)
+			return newFrame;
+		if (m_PrefetchThread == NULL) {
+			StartPrefetch();
+			continue;
 		}
-		if (UpperElementLevel < 0) {
-			UpperElementLevel = 0;
+		if (m_PrefetchDone) {
+			// The last frames may have come with the end of the thread
+			newFrame = m_FrameRing.Take();
+			if (newFrame != NULL)
+				return newFrame;
+			// End of the track or an error, which the synchronous read reports
+			return ReadSingleFrame();
 		}
-        if (bInfoOnly) {
-            if (m_ClusterIndex.size() >= 1) break;
-        }
 
-		if (EbmlId(*l2) == KaxSeek::ClassInfos.GlobalId) {
-			//Wow we found the SeekEntries, time to speed up reading ;)
-			l3 = ElementPtr(m_InputStream.FindNextElement(l2->Generic().Context, UpperElementLevel, 0xFFFFFFFFFFFFFFFFL, true, 1));
+		HANDLE events[2] = { m_PrefetchReadyEvent, p_abort.get_abort_event() };
+		WaitForMultipleObjects(2, events, FALSE, INFINITE);
+		p_abort.check();
+	}
+};
 
-			EbmlIdPtr id;
-			while (l3 != NullElement) {
-				if (UpperElementLevel > 0) {
-					break;
-				}
-				if (UpperElementLevel < 0) {
-					UpperElementLevel = 0;
-				}
-                if (bInfoOnly) {
-                    if (m_ClusterIndex.size() >= 1) break;
-                }
+void MatroskaAudioParser::EnablePrefetch(bool enable)
+{
+	if (!enable)
+		StopPrefetch();
+	m_PrefetchEnabled = enable;
+}
 
-				if (EbmlId(*l3) == KaxSeekID::ClassInfos.GlobalId) {
-					binary *b = NULL;
+void MatroskaAudioParser::StartPrefetch()
+{
+	// The frames already in m_Queue are handed over first by the thread
+	m_PrefetchStop = false;
+	m_PrefetchDone = false;
+	m_PrefetchWaiting = 0;
+	ResetEvent(m_PrefetchReadyEvent);
+	ResetEvent(m_PrefetchFreeEvent);
+	// Only the thread reads the file until StopPrefetch()
+	m_PrefetchAbort.reset();
+	m_IOCallback.SetAbort(&m_PrefetchAbort);
+	DWORD threadId;
+	m_PrefetchThread = CreateThread(NULL, 0, PrefetchThreadProc, this, 0, &threadId);
+	if (m_PrefetchThread == NULL) {
+		// Read on the calling thread instead
+		m_IOCallback.SetAbort(NULL);
+		m_PrefetchDone = true;
+	}
+}
+
+void MatroskaAudioParser::StopPrefetch(bool keepFrames)
+{
+	if (m_PrefetchThread != NULL) {
+		m_PrefetchStop = true;
+		// Don't wait for a slow read to complete
+		m_PrefetchAbort.abort();
+		SetEvent(m_PrefetchFreeEvent);
+		WaitForSingleObject(m_PrefetchThread, INFINITE);
+		CloseHandle(m_PrefetchThread);
+		m_PrefetchThread = NULL;
+		m_IOCallback.SetAbort(NULL);
+	}
+
+	if (!keepFrames) {
+		m_FrameRing.Flush();
+		return;
+	}
+	// m_CurrentTimecode is already past these frames, they go back in front
+	if (m_FrameRing.IsEmpty())
+		return;
+	std::queue<MatroskaAudioFrame *> frames;
+	for (;;) {
+		MatroskaAudioFrame *frame = NewFrame();
+		if (!m_FrameRing.TakeInto(*frame)) {
+			ReleaseFrame(frame);
+			break;
+		}
+		frames.push(frame);
+	}
+	while (!m_Queue.empty()) {
+		frames.push(m_Queue.front());
+		m_Queue.pop();
+	}
+	m_Queue = frames;
+}
+
+DWORD WINAPI MatroskaAudioParser::PrefetchThreadProc(LPVOID param)
+{
+	static_cast<MatroskaAudioParser *>(param)->PrefetchThread();
+	return 0;
+}
+
+void MatroskaAudioParser::PrefetchThread()
+{
+	int ret = 0;
+	for (;;) {
+		// Hand the parsed frames over, waiting for room when the decoder is behind
+		while (!m_Queue.empty() && !m_PrefetchStop) {
+			MatroskaAudioFrame *ringFrame = m_FrameRing.GetWriteFrame();
+			if (ringFrame == NULL) {
+				// Make sure the reader isn't waiting for the frames already committed
+				SetEvent(m_PrefetchReadyEvent);
+				InterlockedExchange(&m_PrefetchWaiting, 1);
+				if (m_FrameRing.GetWriteFrame() == NULL)
+					WaitForSingleObject(m_PrefetchFreeEvent, INFINITE);
+				InterlockedExchange(&m_PrefetchWaiting, 0);
+				continue;
+			}
+			MatroskaAudioFrame *frame = m_Queue.front();
+			m_Queue.pop();
+			ringFrame->Swap(*frame);
+			ReleaseFrame(frame);
+			m_FrameRing.Commit();
+		}
+		if (m_PrefetchStop)
+			break;
+		if (ret != 0) {
+			m_PrefetchDone = true;
+			SetEvent(m_PrefetchReadyEvent);
+			break;
+		}
+		SetEvent(m_PrefetchReadyEvent);
+
+		uint64 fillTimecode = m_CurrentTimecode;
+		uint64 fillSeekTimecode = m_SeekTimecode;
+		bool fillSeekRepeat = m_SeekRepeat;
+		try {
+			ret = FillQueue();
+		} catch (...) {
+			// Left for the reader to run into again
+			flush_queue();
+			ret = 1;
+		}
+		if (ret != 0) {
+			// Aborted or failed, the reader starts this cluster over
+			m_CurrentTimecode = fillTimecode;
+			m_SeekTimecode = fillSeekTimecode;
+			m_SeekRepeat = fillSeekRepeat;
+			if (m_PrefetchStop)
+				break;
+		}
+	}
+}
+
+MatroskaAudioFrame * MatroskaAudioParser::ReadFirstFrame()
+{
+	StopPrefetch();
+    m_CurrentTimecode = 0;
+    return ReadSingleFrame();
+};
+
+/// Frames kept for reuse, more than a cluster usually holds
+#define FRAME_POOL_SIZE 1024
+
+MatroskaAudioFrame * MatroskaAudioParser::NewFrame()
+{
+	insync(m_FramePoolSync);
+	if (m_FramePool.empty()) {
+		m_FramePoolMisses++;
+		return new MatroskaAudioFrame;
+	}
+	MatroskaAudioFrame *frame = m_FramePool.back();
+	m_FramePool.pop_back();
+	return frame;
+}
+
+void MatroskaAudioParser::ReleaseFrame(MatroskaAudioFrame *frame)
+{
+	if (frame == NULL)
+		return;
+	if (m_FrameRing.Owns(frame)) {
+		// Handed over by the prefetch thread, no lock needed
+		m_FrameRing.Release(frame);
+		if (m_PrefetchWaiting)
+			SetEvent(m_PrefetchFreeEvent);
+		return;
+	}
+	insync(m_FramePoolSync);
+	if (m_FramePool.size() >= FRAME_POOL_SIZE) {
+		delete frame;
+		return;
+	}
+	frame->Reset();
+	m_FramePool.push_back(frame);
+}
+
+typedef boost::shared_ptr<EbmlId> EbmlIdPtr;
+
+void MatroskaAudioParser::Parse_MetaSeek(ElementPtr metaSeekElement, bool bInfoOnly) 
+{
+    TIMER;
+	uint64 lastSeekPos = 0;
+	uint64 endSeekPos = 0;
+	ElementPtr l2;
+	ElementPtr l3;
+	ElementPtr NullElement;
+	int UpperElementLevel = 0;
+
+	if (metaSeekElement == NullElement)
+		return;
+
+	l2 = ElementPtr(m_InputStream.FindNextElement(metaSeekElement->Generic().Context, UpperElementLevel, 0xFFFFFFFFFFFFFFFFL, true, 1));
+	while (l2 != NullElement) {
+		if (UpperElementLevel > 0) {
+			break;
+		}
+		if (UpperElementLevel < 0) {
+			UpperElementLevel = 0;
+		}
+
+		if (EbmlId(*l2) == KaxSeek::ClassInfos.GlobalId) {
+			//Wow we found the SeekEntries, time to speed up reading ;)
+			l3 = ElementPtr(m_InputStream.FindNextElement(l2->Generic().Context, UpperElementLevel, 0xFFFFFFFFFFFFFFFFL, true, 1));
+
+			EbmlIdPtr id;
+			while (l3 != NullElement) {
+				if (UpperElementLevel > 0) {
+					break;
+				}
+				if (UpperElementLevel < 0) {
+					UpperElementLevel = 0;
+				}
+
+				if (EbmlId(*l3) == KaxSeekID::ClassInfos.GlobalId) {
+					binary *b = NULL;
 					uint16 s = 0;
 					KaxSeekID &seek_id = static_cast<KaxSeekID &>(*l3);
 					seek_id.ReadData(m_InputStream.I_O(), SCOPE_ALL_DATA);
@@ -1719,11 +2161,33 @@ void MatroskaAudioParser::Parse_MetaSeek(ElementPtr metaSeekElement, bool bInfoO
 					if (*id == KaxCluster::ClassInfos.GlobalId) {
 						//NOTE1("Found Cluster Seek Entry Postion: %u", (unsigned long)lastSeekPos);
 						//uint64 orig_pos = inputFile.getFilePointer();
-						//MatroskaMetaSeekClusterEntry newCluster;
-                        cluster_entry_ptr newCluster(new MatroskaMetaSeekClusterEntry());
-						newCluster->timecode = MAX_UINT64;
-						newCluster->filePos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
-						m_ClusterIndex.push_back(newCluster);
+						// Info reads don't index the clusters, the entries after them still count
+						if (!bInfoOnly)
+							m_ClusterIndex.Append(static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos), MAX_UINT64);
+
+					} else if (*id == KaxCues::ClassInfos.GlobalId) {
+						NOTE1("Found Cues Seek Entry Postion: %u", (unsigned long)lastSeekPos);
+						m_CuesPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
+
+					} else if (*id == KaxInfo::ClassInfos.GlobalId) {
+						if (m_SeekInfoPos == 0)
+							m_SeekInfoPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
+
+					} else if (*id == KaxTracks::ClassInfos.GlobalId) {
+						if (m_SeekTracksPos == 0)
+							m_SeekTracksPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
+
+					} else if (*id == KaxChapters::ClassInfos.GlobalId) {
+						if (m_SeekChaptersPos == 0)
+							m_SeekChaptersPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
+
+					} else if (*id == KaxTags::ClassInfos.GlobalId) {
+						if (m_SeekTagsPos == 0)
+							m_SeekTagsPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
+
+					} else if (*id == KaxAttachments::ClassInfos.GlobalId) {
+						if (m_SeekAttachmentsPos == 0)
+							m_SeekAttachmentsPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(lastSeekPos);
 
 					} else if (*id == KaxSeekHead::ClassInfos.GlobalId) {
 						NOTE1("Found MetaSeek Seek Entry Postion: %u", (unsigned long)lastSeekPos);
@@ -1762,6 +2226,422 @@ void MatroskaAudioParser::Parse_MetaSeek(ElementPtr metaSeekElement, bool bInfoO
 
 #define IS_ELEMENT_ID(__x__) (Element->Generic().GlobalId == __x__::ClassInfos.GlobalId)
 
+void MatroskaAudioParser::Parse_Info(KaxInfo *infoElement)
+{
+	int UpperElementLevel = 0;
+	bool bAllowDummy = false;
+	ElementPtr ElementLevel2;
+	ElementPtr ElementLevel3;
+	ElementPtr NullElement;
+
+	if (infoElement == NULL)
+		return;
+
+	// General info about this Matroska file
+	ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(infoElement->Generic().Context, UpperElementLevel, infoElement->ElementSize(), bAllowDummy));
+	while (ElementLevel2 != NullElement) {
+		if (UpperElementLevel > 0) {
+			break;
+		}
+		if (UpperElementLevel < 0) {
+			UpperElementLevel = 0;
+		}
+
+		if (EbmlId(*ElementLevel2) == KaxTimecodeScale::ClassInfos.GlobalId) {
+			KaxTimecodeScale &TimeScale = *static_cast<KaxTimecodeScale *>(ElementLevel2.get());
+			TimeScale.ReadData(m_InputStream.I_O());
+
+			//matroskaGlobalTrack->SetTimecodeScale(uint64(TimeScale));
+			m_TimecodeScale = uint64(TimeScale);
+		} else if (EbmlId(*ElementLevel2) == KaxDuration::ClassInfos.GlobalId) {
+			KaxDuration &duration = *static_cast<KaxDuration *>(ElementLevel2.get());
+			duration.ReadData(m_InputStream.I_O());
+
+			// it's in milliseconds? -- in nanoseconds.
+			m_Duration = double(duration) * m_TimecodeScale;
+
+		} else if (EbmlId(*ElementLevel2) == KaxDateUTC::ClassInfos.GlobalId) {
+			KaxDateUTC & DateUTC = *static_cast<KaxDateUTC *>(ElementLevel2.get());
+			DateUTC.ReadData(m_InputStream.I_O());
+			
+			m_FileDate = DateUTC.GetEpochDate();
+
+		} else if (EbmlId(*ElementLevel2) == KaxSegmentFilename::ClassInfos.GlobalId) {
+			KaxSegmentFilename &tag_SegmentFilename = *static_cast<KaxSegmentFilename *>(ElementLevel2.get());
+			tag_SegmentFilename.ReadData(m_InputStream.I_O());
+
+			m_SegmentFilename = *static_cast<EbmlUnicodeString *>(&tag_SegmentFilename);
+
+		} else if (EbmlId(*ElementLevel2) == KaxMuxingApp::ClassInfos.GlobalId)	{
+			KaxMuxingApp &tag_MuxingApp = *static_cast<KaxMuxingApp *>(ElementLevel2.get());
+			tag_MuxingApp.ReadData(m_InputStream.I_O());
+
+			m_MuxingApp = *static_cast<EbmlUnicodeString *>(&tag_MuxingApp);
+
+		} else if (EbmlId(*ElementLevel2) == KaxWritingApp::ClassInfos.GlobalId) {
+			KaxWritingApp &tag_WritingApp = *static_cast<KaxWritingApp *>(ElementLevel2.get());
+			tag_WritingApp.ReadData(m_InputStream.I_O());
+			
+			m_WritingApp = *static_cast<EbmlUnicodeString *>(&tag_WritingApp);
+
+		} else if (EbmlId(*ElementLevel2) == KaxTitle::ClassInfos.GlobalId) {
+			KaxTitle &Title = *static_cast<KaxTitle*>(ElementLevel2.get());
+			Title.ReadData(m_InputStream.I_O());
+			m_FileTitle = UTFstring(Title).c_str();
+		}
+
+		if (UpperElementLevel > 0) {	// we're coming from ElementLevel3
+			UpperElementLevel--;
+			//delete ElementLevel2;
+			ElementLevel2 = ElementLevel3;
+			if (UpperElementLevel > 0)
+				break;
+		} else {
+			ElementLevel2->SkipData(m_InputStream, ElementLevel2->Generic().Context);
+			//delete ElementLevel2;
+			//_DELETE(ElementLevel2);
+			ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(infoElement->Generic().Context, UpperElementLevel, infoElement->ElementSize(), bAllowDummy));
+		}
+	}
+}
+
+/// bzlib and lzo1x compressed tracks can't be played
+static bool IsSupportedCompression(uint32 algo)
+{
+	return (algo == MATROSKA_COMPRESSION_NONE) || (algo == MATROSKA_COMPRESSION_ZLIB) || (algo == MATROSKA_COMPRESSION_HEADER_STRIPPING);
+}
+
+void MatroskaAudioParser::Parse_Tracks(KaxTracks *tracksElement)
+{
+	int UpperElementLevel = 0;
+	bool bAllowDummy = false;
+
+	if (tracksElement == NULL)
+		return;
+
+	// Yep, we've found our KaxTracks element. Now find all tracks
+	// contained in this segment. 
+	EbmlElement* tmpElement = NULL;
+	tracksElement->Read(m_InputStream, KaxTracks::ClassInfos.Context, UpperElementLevel, tmpElement, bAllowDummy);
+
+	unsigned int Index0;
+	for (Index0 = 0; Index0 < tracksElement->ListSize(); Index0++) {
+		if ((*tracksElement)[Index0]->Generic().GlobalId == KaxTrackEntry::ClassInfos.GlobalId) {
+			KaxTrackEntry &TrackEntry = *static_cast<KaxTrackEntry *>((*tracksElement)[Index0]);
+			// Create a new MatroskaTrack
+			MatroskaTrackInfo newTrack;
+			uint32 codecPrivateAlgo = MATROSKA_COMPRESSION_NONE;
+			
+			unsigned int Index1;
+			for (Index1 = 0; Index1 < TrackEntry.ListSize(); Index1++) {
+				if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackNumber::ClassInfos.GlobalId) {
+					KaxTrackNumber &TrackNumber = *static_cast<KaxTrackNumber*>(TrackEntry[Index1]);
+					newTrack.trackNumber = TrackNumber;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackUID::ClassInfos.GlobalId) {
+					KaxTrackUID &TrackUID = *static_cast<KaxTrackUID*>(TrackEntry[Index1]);
+					newTrack.trackUID = TrackUID;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackType::ClassInfos.GlobalId) {
+					KaxTrackType &TrackType = *static_cast<KaxTrackType*>(TrackEntry[Index1]);
+					if (uint8(TrackType) != track_audio) {
+						m_AudioOnly = false;
+						newTrack.trackNumber = 0xFFFF;
+						break;
+					}
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackTimecodeScale::ClassInfos.GlobalId) {
+					KaxTrackTimecodeScale &TrackTimecodeScale = *static_cast<KaxTrackTimecodeScale*>(TrackEntry[Index1]);
+					// TODO: Support Tracks with different timecode scales?
+					//newTrack->TrackTimecodeScale = TrackTimecodeScale;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackDefaultDuration::ClassInfos.GlobalId) {
+					KaxTrackDefaultDuration &TrackDefaultDuration = *static_cast<KaxTrackDefaultDuration*>(TrackEntry[Index1]);
+					newTrack.defaultDuration = uint64(TrackDefaultDuration);
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxCodecID::ClassInfos.GlobalId) {
+					KaxCodecID &CodecID = *static_cast<KaxCodecID*>(TrackEntry[Index1]);
+					newTrack.codecID = std::string(CodecID);
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxCodecPrivate::ClassInfos.GlobalId) {
+					KaxCodecPrivate &CodecPrivate = *static_cast<KaxCodecPrivate*>(TrackEntry[Index1]);
+					newTrack.codecPrivate.resize(CodecPrivate.GetSize());								
+					memcpy(&newTrack.codecPrivate[0], CodecPrivate.GetBuffer(), CodecPrivate.GetSize());
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxContentEncodings::ClassInfos.GlobalId) {
+					KaxContentEncodings &ContentEncodings = *static_cast<KaxContentEncodings*>(TrackEntry[Index1]);
+
+					// Only a single ContentCompression is supported, encrypted tracks are left to fail in the decoder
+					unsigned int Index2;
+					for (Index2 = 0; Index2 < ContentEncodings.ListSize(); Index2++) {
+						if (ContentEncodings[Index2]->Generic().GlobalId != KaxContentEncoding::ClassInfos.GlobalId)
+							continue;
+						KaxContentEncoding &ContentEncoding = *static_cast<KaxContentEncoding*>(ContentEncodings[Index2]);
+						// Frames only, unless the scope says otherwise
+						uint32 scope = 1;
+
+						unsigned int Index3;
+						for (Index3 = 0; Index3 < ContentEncoding.ListSize(); Index3++) {
+							if (ContentEncoding[Index3]->Generic().GlobalId == KaxContentEncodingScope::ClassInfos.GlobalId) {
+								KaxContentEncodingScope &ContentEncodingScope = *static_cast<KaxContentEncodingScope*>(ContentEncoding[Index3]);
+								scope = uint32(ContentEncodingScope);
+
+							} else if (ContentEncoding[Index3]->Generic().GlobalId == KaxContentCompression::ClassInfos.GlobalId) {
+								KaxContentCompression &ContentCompression = *static_cast<KaxContentCompression*>(ContentEncoding[Index3]);
+								newTrack.compressionAlgo = MATROSKA_COMPRESSION_ZLIB;
+
+								unsigned int Index4;
+								for (Index4 = 0; Index4 < ContentCompression.ListSize(); Index4++) {
+									if (ContentCompression[Index4]->Generic().GlobalId == KaxContentCompAlgo::ClassInfos.GlobalId) {
+										KaxContentCompAlgo &ContentCompAlgo = *static_cast<KaxContentCompAlgo*>(ContentCompression[Index4]);
+										newTrack.compressionAlgo = uint32(ContentCompAlgo);
+
+									} else if (ContentCompression[Index4]->Generic().GlobalId == KaxContentCompSettings::ClassInfos.GlobalId) {
+										KaxContentCompSettings &ContentCompSettings = *static_cast<KaxContentCompSettings*>(ContentCompression[Index4]);
+										newTrack.compressionSettings.assign(ContentCompSettings.GetBuffer(), ContentCompSettings.GetBuffer() + ContentCompSettings.GetSize());
+									}
+								}
+							}
+						}
+						if (newTrack.compressionAlgo != MATROSKA_COMPRESSION_NONE) {
+							if (scope & 2)
+								codecPrivateAlgo = newTrack.compressionAlgo;
+							if ((scope & 1) == 0)
+								newTrack.compressionAlgo = MATROSKA_COMPRESSION_NONE;
+							break;
+						}
+					}
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackFlagDefault::ClassInfos.GlobalId) {
+					KaxTrackFlagDefault &TrackFlagDefault = *static_cast<KaxTrackFlagDefault*>(TrackEntry[Index1]);
+					//newTrack->FlagDefault = TrackFlagDefault;
+				/* Matroska2
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackFlagEnabled::ClassInfos.GlobalId) {
+					KaxTrackFlagEnabled &TrackFlagEnabled = *static_cast<KaxTrackFlagEnabled*>(TrackEntry[Index1]);
+					//newTrack->FlagEnabled = TrackFlagEnabled;
+				*/
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackFlagLacing::ClassInfos.GlobalId) {
+					KaxTrackFlagLacing &TrackFlagLacing = *static_cast<KaxTrackFlagLacing*>(TrackEntry[Index1]);
+					//newTrack->FlagLacing = TrackFlagLacing;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackLanguage::ClassInfos.GlobalId) {
+					KaxTrackLanguage &TrackLanguage = *static_cast<KaxTrackLanguage*>(TrackEntry[Index1]);
+					newTrack.language = std::string(TrackLanguage);
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackMaxCache::ClassInfos.GlobalId) {
+					KaxTrackMaxCache &TrackMaxCache = *static_cast<KaxTrackMaxCache*>(TrackEntry[Index1]);
+					//newTrack->MaxCache = TrackMaxCache;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackMinCache::ClassInfos.GlobalId) {
+					KaxTrackMinCache &TrackMinCache = *static_cast<KaxTrackMinCache*>(TrackEntry[Index1]);
+					//newTrack->MinCache = TrackMinCache;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackName::ClassInfos.GlobalId) {
+					KaxTrackName &TrackName = *static_cast<KaxTrackName*>(TrackEntry[Index1]);
+					newTrack.name = TrackName;
+
+				} else if (TrackEntry[Index1]->Generic().GlobalId == KaxTrackAudio::ClassInfos.GlobalId) {
+					KaxTrackAudio &TrackAudio = *static_cast<KaxTrackAudio*>(TrackEntry[Index1]);
+
+					unsigned int Index2;
+					for (Index2 = 0; Index2 < TrackAudio.ListSize(); Index2++) {
+						if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioBitDepth::ClassInfos.GlobalId) {
+							KaxAudioBitDepth &AudioBitDepth = *static_cast<KaxAudioBitDepth*>(TrackAudio[Index2]);
+							newTrack.bitsPerSample = AudioBitDepth;
+						/* Matroska2
+						} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioPosition::ClassInfos.GlobalId) {
+							KaxAudioPosition &AudioPosition = *static_cast<KaxAudioPosition*>(TrackAudio[Index2]);
+
+							// TODO: Support multi-channel?
+							//newTrack->audio->ChannelPositionSize = AudioPosition.GetSize();
+							//newTrack->audio->ChannelPosition = new binary[AudioPosition.GetSize()+1];
+							//memcpy(newTrack->audio->ChannelPosition, AudioPosition.GetBuffer(), AudioPosition.GetSize());
+						*/
+						} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioChannels::ClassInfos.GlobalId) {
+							KaxAudioChannels &AudioChannels = *static_cast<KaxAudioChannels*>(TrackAudio[Index2]);
+							newTrack.channels = AudioChannels;
+
+						} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioOutputSamplingFreq::ClassInfos.GlobalId) {
+							KaxAudioOutputSamplingFreq &AudioOutputSamplingFreq = *static_cast<KaxAudioOutputSamplingFreq*>(TrackAudio[Index2]);
+							newTrack.samplesOutputPerSec = AudioOutputSamplingFreq;
+
+						} else if (TrackAudio[Index2]->Generic().GlobalId == KaxAudioSamplingFreq::ClassInfos.GlobalId) {
+							KaxAudioSamplingFreq &AudioSamplingFreq = *static_cast<KaxAudioSamplingFreq*>(TrackAudio[Index2]);
+							newTrack.samplesPerSec = AudioSamplingFreq;
+						}
+					}
+				}
+			}
+			// The CodecPrivate is decoded once here, the decoders never see its compression
+			if (codecPrivateAlgo == MATROSKA_COMPRESSION_HEADER_STRIPPING) {
+				newTrack.codecPrivate.insert(newTrack.codecPrivate.begin(), newTrack.compressionSettings.begin(), newTrack.compressionSettings.end());
+			} else if ((codecPrivateAlgo == MATROSKA_COMPRESSION_ZLIB) && !newTrack.codecPrivate.empty()) {
+				size_t inflatedSize;
+				if (Inflate(&newTrack.codecPrivate[0], newTrack.codecPrivate.size(), inflatedSize))
+					newTrack.codecPrivate.assign(m_InflateBuffer.begin(), m_InflateBuffer.begin() + inflatedSize);
+				else
+					NOTE("MatroskaAudioParser::Parse_Tracks() - Broken zlib CodecPrivate");
+			}
+			if (!IsSupportedCompression(newTrack.compressionAlgo) || !IsSupportedCompression(codecPrivateAlgo)) {
+				// Not offered at all, its blocks are skipped like those of other track types
+				NOTE("MatroskaAudioParser::Parse_Tracks() - Unsupported ContentCompAlgo");
+				m_AudioOnly = false;
+				newTrack.trackNumber = 0xFFFF;
+			}
+			if (newTrack.trackNumber != 0xFFFF)
+				m_Tracks.push_back(newTrack);
+		}
+	}
+}
+
+void MatroskaAudioParser::Parse_Attachments(KaxAttachments *attachmentsElement)
+{
+	int UpperElementLevel = 0;
+	ElementPtr ElementLevel2;
+	ElementPtr ElementLevel3;
+	ElementPtr ElementLevel4;
+	ElementPtr NullElement;
+
+	if (attachmentsElement == NULL)
+		return;
+
+	// Yep, we've found our KaxAttachment element. Now find all attached files
+	// contained in this segment.
+#if 1
+	ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(attachmentsElement->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
+	while (ElementLevel2 != NullElement) {
+		if (UpperElementLevel > 0) {
+			break;
+		}
+		if (UpperElementLevel < 0) {
+			UpperElementLevel = 0;
+		}
+		if (EbmlId(*ElementLevel2) == KaxAttached::ClassInfos.GlobalId) {
+			// We actually found a attached file entry :D
+			MatroskaAttachment newAttachment;
+
+			ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
+			while (ElementLevel3 != NullElement) {
+				if (UpperElementLevel > 0) {
+					break;
+				}
+				if (UpperElementLevel < 0) {
+					UpperElementLevel = 0;
+				}
+
+				// Now evaluate the data belonging to this track
+				if (EbmlId(*ElementLevel3) == KaxFileName::ClassInfos.GlobalId) {
+					KaxFileName &attached_filename = *static_cast<KaxFileName *>(ElementLevel3.get());
+					attached_filename.ReadData(m_InputStream.I_O());
+					newAttachment.FileName = UTFstring(attached_filename);
+
+				} else if (EbmlId(*ElementLevel3) == KaxMimeType::ClassInfos.GlobalId) {
+					KaxMimeType &attached_mime_type = *static_cast<KaxMimeType *>(ElementLevel3.get());
+					attached_mime_type.ReadData(m_InputStream.I_O());
+					newAttachment.MimeType = std::string(attached_mime_type);
+
+				} else if (EbmlId(*ElementLevel3) == KaxFileDescription::ClassInfos.GlobalId) {
+					KaxFileDescription &attached_description = *static_cast<KaxFileDescription *>(ElementLevel3.get());
+					attached_description.ReadData(m_InputStream.I_O());
+					newAttachment.Description = UTFstring(attached_description);
+
+				} else if (EbmlId(*ElementLevel3) == KaxFileData::ClassInfos.GlobalId) {
+					KaxFileData &attached_data = *static_cast<KaxFileData *>(ElementLevel3.get());
+
+					//We don't what to read the data into memory because it could be very large
+					//attached_data.ReadData(m_InputStream.I_O());
+
+					//Instead we store the Matroska filename, the start of the data and the length, so we can read it
+					//later at the users request. IMHO This will save a lot of memory
+					newAttachment.SourceStartPos = attached_data.GetElementPosition() + attached_data.HeadSize();
+					newAttachment.SourceDataLength = attached_data.GetSize();
+				}
+
+				if (UpperElementLevel > 0) {	// we're coming from ElementLevel4
+					UpperElementLevel--;
+					ElementLevel3 = ElementLevel4;
+					if (UpperElementLevel > 0)
+						break;
+				} else {
+					ElementLevel3->SkipData(m_InputStream, ElementLevel3->Generic().Context);
+					ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
+				}					
+			} // while (ElementLevel3 != NULL)
+			//m_AttachmentList.push_back(newAttachment);
+                        m_AttachmentList.add_item(newAttachment);
+		}
+
+		if (UpperElementLevel > 0) {	// we're coming from ElementLevel3
+			UpperElementLevel--;
+			ElementLevel2 = ElementLevel3;
+			if (UpperElementLevel > 0)
+				break;
+		} else {
+			ElementLevel2->SkipData(m_InputStream, ElementLevel2->Generic().Context);
+			ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(attachmentsElement->Generic().Context, UpperElementLevel, 0xFFFFFFFFL, true, 1));
+		}
+	} // while (ElementLevel2 != NULL)
+#endif
+}
+
+bool MatroskaAudioParser::MarkElementParsed(EbmlElement &element)
+{
+	uint64 filePos = element.GetElementPosition();
+	if (std::find(m_ParsedElements.begin(), m_ParsedElements.end(), filePos) != m_ParsedElements.end())
+		return false;
+	m_ParsedElements.push_back(filePos);
+	return true;
+}
+
+ElementPtr MatroskaAudioParser::FindElementAt(uint64 filePos, const EbmlCallbacks &classInfos)
+{
+	binary buffer[EBML_MAX_HEADER_SIZE];
+	EbmlElementHeader header;
+
+	// FindNextID() would search further on, the ID has to be right at filePos
+	m_IOCallback.setFilePointer(filePos);
+	uint32 bufferSize = m_IOCallback.read(buffer, sizeof(buffer));
+	if (!ReadEbmlElementHeader(buffer, bufferSize, header) || (header.id != classInfos.GlobalId.Value))
+		return ElementPtr();
+
+	m_IOCallback.setFilePointer(filePos);
+	ElementPtr element = ElementPtr(m_InputStream.FindNextID(classInfos, 0xFFFFFFFFFFFFFFFFL));
+	if ((element.get() == NULL) || !(EbmlId(*element) == classInfos.GlobalId))
+		return ElementPtr();
+	return element;
+}
+
+void MatroskaAudioParser::Parse_SeekTargets()
+{
+	ElementPtr element;
+
+	if (m_SeekInfoPos != 0) {
+		element = FindElementAt(m_SeekInfoPos, KaxInfo::ClassInfos);
+		if ((element.get() != NULL) && MarkElementParsed(*element))
+			Parse_Info(static_cast<KaxInfo *>(element.get()));
+	}
+	if (m_SeekTracksPos != 0) {
+		element = FindElementAt(m_SeekTracksPos, KaxTracks::ClassInfos);
+		if ((element.get() != NULL) && MarkElementParsed(*element))
+			Parse_Tracks(static_cast<KaxTracks *>(element.get()));
+	}
+	if (m_SeekChaptersPos != 0) {
+		element = FindElementAt(m_SeekChaptersPos, KaxChapters::ClassInfos);
+		if ((element.get() != NULL) && MarkElementParsed(*element))
+			Parse_Chapters(static_cast<KaxChapters *>(element.get()));
+	}
+	if (m_SeekTagsPos != 0) {
+		element = FindElementAt(m_SeekTagsPos, KaxTags::ClassInfos);
+		if ((element.get() != NULL) && MarkElementParsed(*element))
+			Parse_Tags(static_cast<KaxTags *>(element.get()));
+	}
+	if (m_SeekAttachmentsPos != 0) {
+		element = FindElementAt(m_SeekAttachmentsPos, KaxAttachments::ClassInfos);
+		if ((element.get() != NULL) && MarkElementParsed(*element))
+			Parse_Attachments(static_cast<KaxAttachments *>(element.get()));
+	}
+}
+
 void MatroskaAudioParser::Parse_Chapter_Atom(KaxChapterAtom *ChapterAtom)
 {
 	Parse_Chapter_Atom(ChapterAtom, m_Chapters);
@@ -2003,44 +2883,177 @@ void MatroskaAudioParser::Parse_Tags(KaxTags *tagsElement)
 	}
 };
 
-int MatroskaAudioParser::FillQueue() 
+static bool CuePointLess(const MatroskaCuePoint &cue1, const MatroskaCuePoint &cue2)
 {
-	flush_queue();
-
-	NOTE("MatroskaAudioParser::FillQueue()");
+	if (cue1.track != cue2.track)
+		return cue1.track < cue2.track;
+	return cue1.timecode < cue2.timecode;
+}
 
-	int UpperElementLevel = 0;
-	bool bAllowDummy = false;
-	// Elements for different levels
-	ElementPtr ElementLevel1;
-	ElementPtr ElementLevel2;
-	ElementPtr ElementLevel3;
-	ElementPtr ElementLevel4;
-    ElementPtr ElementLevel5;
-	ElementPtr NullElement;
-	//m_framebuffer.set_size(0);
+void MatroskaAudioParser::Parse_Cues(KaxCues *cuesElement)
+{
+	int i, j, k;
+	EbmlElement *Element = NULL;
+	int UpperEltFound = 0;
+	// libmatroska doesn't know CueRelativePosition, it comes back as a dummy element
+	const EbmlId CueRelativePositionId(0xF0, 1);
 
-	if (m_IOCallback.seekable()) {
-		cluster_entry_ptr currentCluster = FindCluster(m_CurrentTimecode);
-		if (currentCluster.get() == NULL)
-			return 2;
-		int64 clusterFilePos = currentCluster->filePos;
+	if (cuesElement == NULL)
+		return;
 
-		//console::info(uStringPrintf("cluster %d", currentCluster->clusterNo));
+	TIMER;
+	cuesElement->Read(m_InputStream, KaxCues::ClassInfos.Context, UpperEltFound, Element, true);
 
-		m_IOCallback.setFilePointer(clusterFilePos);
-		// Find the element data
-		ElementLevel1 = ElementPtr(m_InputStream.FindNextID(KaxCluster::ClassInfos, 0xFFFFFFFFFFFFFFFFL));
-		if (ElementLevel1 == NullElement)
-			return 1;
+	KaxSegment *segment = static_cast<KaxSegment *>(m_ElementLevel0.get());
+	for (i = 0; i < cuesElement->ListSize(); i++)
+	{
+		Element = (*cuesElement)[i];
+		if(IS_ELEMENT_ID(KaxCuePoint))
+		{
+			KaxCuePoint *cuePointElement = (KaxCuePoint*)Element;
+			uint64 cueTime = MAX_UINT64;
+			size_t firstCue = m_CueIndex.size();
+			for (j = 0; j < cuePointElement->ListSize(); j++)
+			{
+				Element = (*cuePointElement)[j];
+				if(IS_ELEMENT_ID(KaxCueTime))
+				{
+					cueTime = uint64(*static_cast<EbmlUInteger *>(Element)) * m_TimecodeScale;
+				}
+				else if(IS_ELEMENT_ID(KaxCueTrackPositions))
+				{
+					MatroskaCuePoint newCue;
+					KaxCueTrackPositions *positionsElement = (KaxCueTrackPositions*)Element;
+					for (k = 0; k < positionsElement->ListSize(); k++)
+					{
+						Element = (*positionsElement)[k];
+						if(IS_ELEMENT_ID(KaxCueTrack))
+						{
+							newCue.track = uint16(*static_cast<EbmlUInteger *>(Element));
+						}
+						else if(IS_ELEMENT_ID(KaxCueClusterPosition))
+						{
+							newCue.clusterPos = segment->GetGlobalPosition(uint64(*static_cast<EbmlUInteger *>(Element)));
+						}
+						else if(IS_ELEMENT_ID(KaxCueBlockNumber))
+						{
+							newCue.blockNumber = uint32(*static_cast<EbmlUInteger *>(Element));
+						}
+						else if(EbmlId(*Element) == CueRelativePositionId)
+						{
+							EbmlBinary *relativePosition = static_cast<EbmlBinary *>(Element);
+							newCue.relativePos = ReadEbmlUInteger(relativePosition->GetBuffer(), relativePosition->GetSize());
+						}
+					}
+					if (newCue.clusterPos != 0)
+						m_CueIndex.push_back(newCue);
+				}
+			}
+			// The CueTime is allowed to come after the track positions
+			if (cueTime == MAX_UINT64) {
+				m_CueIndex.resize(firstCue);
+			} else {
+				for (size_t c = firstCue; c < m_CueIndex.size(); c++)
+					m_CueIndex.at(c).timecode = cueTime;
+			}
+		}
+	}
+	std::sort(m_CueIndex.begin(), m_CueIndex.end(), CuePointLess);
+
+	// Every cued cluster goes into the cluster index, most SeekHeads only list a few
+	m_ClusterIndex.Sort();
+	std::vector<uint64> cuePositions;
+	cuePositions.reserve(m_CueIndex.size());
+	for (size_t c = 0; c < m_CueIndex.size(); c++)
+		cuePositions.push_back(m_CueIndex.at(c).clusterPos);
+	std::sort(cuePositions.begin(), cuePositions.end());
+	cuePositions.erase(std::unique(cuePositions.begin(), cuePositions.end()), cuePositions.end());
+	for (size_t c = 0; c < cuePositions.size(); c++) {
+		if (m_ClusterIndex.Find(cuePositions.at(c)) == CLUSTER_NOT_FOUND)
+			m_ClusterIndex.Append(cuePositions.at(c), MAX_UINT64);
+	}
+	m_ClusterIndex.Sort();
+	_TIMER("Parse_Cues");
+};
 
-		if (EbmlId(*ElementLevel1) == KaxCluster::ClassInfos.GlobalId) {
+int MatroskaAudioParser::FillQueue() 
+{
+	flush_queue();
+	PrepareClusterBuffer();
+	m_EncodedFrames.clear();
+
+	NOTE("MatroskaAudioParser::FillQueue()");
+
+	uint64 seekTimecode = m_SeekTimecode;
+	m_SeekTimecode = MAX_UINT64;
+	bool bSeekRepeat = m_SeekRepeat;
+	m_SeekRepeat = false;
+	int streamRet = 0;
+
+	int UpperElementLevel = 0;
+	bool bAllowDummy = false;
+	// Elements for different levels
+	ElementPtr ElementLevel1;
+	ElementPtr ElementLevel2;
+	ElementPtr ElementLevel3;
+	ElementPtr ElementLevel4;
+    ElementPtr ElementLevel5;
+	ElementPtr NullElement;
+	// SimpleBlock needs a Matroska v2 libmatroska, cluster children are read with dummies allowed
+	const EbmlId SimpleBlockId(0xA3, 1);
+	//m_framebuffer.set_size(0);
+
+	if (m_IOCallback.seekable()) {
+		size_t currentCluster = FindCluster(m_CurrentTimecode);
+		if (IsAtRecordingEdge(currentCluster)) {
+			// Maybe the recorder went on since we last looked
+			UpdateFileSize();
+			currentCluster = FindCluster(m_CurrentTimecode);
+			if (IsAtRecordingEdge(currentCluster))
+				return 3;
+		}
+		if (currentCluster == CLUSTER_NOT_FOUND)
+			return 2;
+		int64 clusterFilePos = m_ClusterIndex.GetPosition(currentCluster);
+
+		//console::info(uStringPrintf("cluster %d", currentCluster));
+
+		uint64 blockStartOffset = 0;
+		if (seekTimecode != MAX_UINT64) {
+			if (bSeekRepeat && (m_SeekClusterPos == (uint64)clusterFilePos))
+				// Start where Seek() counted the frames to skip from
+				blockStartOffset = m_SeekBlockOffset;
+			else
+				blockStartOffset = FindBlockOffset(currentCluster, seekTimecode);
+			m_SeekClusterPos = clusterFilePos;
+			m_SeekBlockOffset = blockStartOffset;
+		}
+
+		// Without other tracks to skip, reading the whole cluster at once is cheapest
+		uint64 nextClusterPos = 0;
+		bool bClusterRead = m_AudioOnly && ReadClusterFromMemory(currentCluster, blockStartOffset, nextClusterPos);
+
+		if (!bClusterRead) {
+			m_IOCallback.setFilePointer(clusterFilePos);
+			// Find the element data
+			ElementLevel1 = ElementPtr(m_InputStream.FindNextID(KaxCluster::ClassInfos, 0xFFFFFFFFFFFFFFFFL));
+			if (ElementLevel1 == NullElement)
+				return 1;
+		}
+
+		if (!bClusterRead && (EbmlId(*ElementLevel1) == KaxCluster::ClassInfos.GlobalId)) {
 			KaxCluster *SegmentCluster = static_cast<KaxCluster *>(ElementLevel1.get());
 			uint32 ClusterTimecode = 0;
+			bool bClusterTimecodeRead = false;
 			MatroskaAudioFrame *prevFrame = NULL;
+			uint64 clusterDataPos = ElementLevel1->GetElementPosition() + ElementLevel1->HeadSize();
+			uint64 blockStartPos = (blockStartOffset != 0) ? clusterDataPos + blockStartOffset : 0;
+			// Only a cluster read from its start gives a complete list of its blocks
+			std::vector<MatroskaBlockOffset> blockOffsets;
+			bool bRecordOffsets = (blockStartPos == 0) && (m_BlockOffsets.find(clusterFilePos) == m_BlockOffsets.end());
 
 			// read blocks and discard the ones we don't care about
-			ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, ElementLevel1->ElementSize(), bAllowDummy));
+			ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, ElementLevel1->ElementSize(), true));
 			while (ElementLevel2 != NullElement) {
 				if (UpperElementLevel > 0) {
 					break;
@@ -2052,13 +3065,25 @@ int MatroskaAudioParser::FillQueue()
 					KaxClusterTimecode & ClusterTime = *static_cast<KaxClusterTimecode*>(ElementLevel2.get());
 					ClusterTime.ReadData(m_InputStream.I_O());
 					ClusterTimecode = uint32(ClusterTime);
-					currentCluster->timecode = ClusterTimecode * m_TimecodeScale;
+					bClusterTimecodeRead = true;
+					m_ClusterIndex.SetTimecode(currentCluster, ClusterTimecode * m_TimecodeScale);
 					SegmentCluster->InitTimecode(ClusterTimecode, m_TimecodeScale);
+				} else if (EbmlId(*ElementLevel2) == SimpleBlockId) {
+					MatroskaAudioFrame *newFrame = NewFrame();
+					if (ReadBlock(*ElementLevel2, ClusterTimecode, *newFrame, true)) {
+						if (bRecordOffsets) {
+							MatroskaBlockOffset blockOffset = { newFrame->timecode, ElementLevel2->GetElementPosition() - clusterDataPos };
+							blockOffsets.push_back(blockOffset);
+						}
+						QueueFrame(newFrame, prevFrame);
+					} else {
+						ReleaseFrame(newFrame);
+					}
 				} else  if (EbmlId(*ElementLevel2) == KaxBlockGroup::ClassInfos.GlobalId) {
 					//KaxBlockGroup & aBlockGroup = *static_cast<KaxBlockGroup*>(ElementLevel2);
 
 					// Create a new frame
-					MatroskaAudioFrame *newFrame = new MatroskaAudioFrame;
+					MatroskaAudioFrame *newFrame = NewFrame();
 
 					ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, ElementLevel2->ElementSize(), bAllowDummy));
 					while (ElementLevel3 != NullElement) {
@@ -2070,36 +3095,8 @@ int MatroskaAudioParser::FillQueue()
 						}
 						if (EbmlId(*ElementLevel3) == KaxBlock::ClassInfos.GlobalId) {								
 							KaxBlock & DataBlock = *static_cast<KaxBlock*>(ElementLevel3.get());														
-							DataBlock.ReadData(m_InputStream.I_O());
-							DataBlock.SetParent(*SegmentCluster);
-
-							//NOTE4("Track # %u / %u frame%s / Timecode %I64d", DataBlock.TrackNum(), DataBlock.NumberFrames(), (DataBlock.NumberFrames() > 1)?"s":"", DataBlock.GlobalTimecode()/m_TimecodeScale);
-							if (DataBlock.TrackNum() == m_Tracks.at(m_CurrentTrackNo).trackNumber) {											
-								newFrame->timecode = DataBlock.GlobalTimecode();
-
-								if (DataBlock.NumberFrames() > 1) {	
-									// The evil lacing has been used
-									newFrame->duration = m_Tracks.at(m_CurrentTrackNo).defaultDuration * DataBlock.NumberFrames();
-
-									newFrame->dataBuffer.resize(DataBlock.NumberFrames());
-									for (uint32 f = 0; f < DataBlock.NumberFrames(); f++) {
-										DataBuffer &buffer = DataBlock.GetBuffer(f);
-										newFrame->dataBuffer[f].resize(buffer.Size());								
-										memcpy(&newFrame->dataBuffer[f][0], buffer.Buffer(), buffer.Size());
-									}
-								} else {
-									// Non-lacing block		
-									newFrame->duration = m_Tracks.at(m_CurrentTrackNo).defaultDuration;
-
-									newFrame->dataBuffer.resize(1);
-									DataBuffer &buffer = DataBlock.GetBuffer(0);
-									newFrame->dataBuffer.at(0).resize(buffer.Size());
-                                        
-									memcpy(&newFrame->dataBuffer.at(0).at(0), buffer.Buffer(), buffer.Size());
-								}
-							} else {
-								//newFrame->timecode = MAX_UINT64;
-							}
+							// Another track's block is skipped by SkipData() without being read
+							ReadBlock(DataBlock, ClusterTimecode, *newFrame, false);
 						/*
 						} else if (EbmlId(*ElementLevel3) == KaxReferenceBlock::ClassInfos.GlobalId) {
 							KaxReferenceBlock & RefTime = *static_cast<KaxReferenceBlock*>(ElementLevel3);
@@ -2169,26 +3166,15 @@ int MatroskaAudioParser::FillQueue()
 						}							
 						//newFrame = new MatroskaReadFrame();
 					}
-					if (newFrame->dataBuffer.size()>0) {
-						m_Queue.push(newFrame);
-						if (prevFrame != NULL && prevFrame->duration == 0) {
-							prevFrame->duration = newFrame->timecode - prevFrame->timecode;
-							//if (newFrame->duration == 0)
-							//	newFrame->duration = prevFrame->duration;
+					if (newFrame->GetLaceCount()>0) {
+						if (bRecordOffsets) {
+							MatroskaBlockOffset blockOffset = { newFrame->timecode, ElementLevel2->GetElementPosition() - clusterDataPos };
+							blockOffsets.push_back(blockOffset);
 						}
-
-						// !!!!!!!!!!!!!!! HACK ALERT !!!!!!!!!!!!!!!!!!!!!!!!
-						// This is an ugly hack to keep us from re-seeking to the same cluster
-						m_CurrentTimecode = newFrame->timecode + (newFrame->duration * 2);
-						if (newFrame->duration == 0) {
-							m_CurrentTimecode += (int64)m_Tracks.at(m_CurrentTrackNo).defaultDuration * 2;
-						}
-						// !!!!!!!!!!!!!!! HACK ALERT !!!!!!!!!!!!!!!!!!!!!!!!
-
-						prevFrame = newFrame;
+						QueueFrame(newFrame, prevFrame);
                     } else {
                         hprintf(L"newFrame ==!! delete!!\n");
-                        _DELETE(newFrame);
+                        ReleaseFrame(newFrame);
                     }
 				}
 
@@ -2206,22 +3192,41 @@ int MatroskaAudioParser::FillQueue()
 					//ElementLevel2 = NULL;
 					//_DELETE(ElementLevel2);
 
-					ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, ElementLevel1->ElementSize(), bAllowDummy));
+					if ((blockStartPos != 0) && bClusterTimecodeRead) {
+						// Seeking inside the cluster, the blocks before are not even read
+						if (blockStartPos > m_IOCallback.getFilePointer())
+							m_IOCallback.setFilePointer(blockStartPos);
+						blockStartPos = 0;
+					}
+					ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, ElementLevel1->ElementSize(), true));
 				}
 			}
+			if (bRecordOffsets)
+				AddBlockOffsets(clusterFilePos, blockOffsets);
 		}
 		//_DELETE(ElementLevel3);
 		//_DELETE(ElementLevel2);
 		//_DELETE(ElementLevel1);
 		//delete ElementLevel1;
+
+		if (!bClusterRead && ElementLevel1->IsFiniteSize())
+			nextClusterPos = ElementLevel1->GetElementPosition() + ElementLevel1->HeadSize() + ElementLevel1->GetSize();
+
+		// Make sure the cluster following this one is in the index, the SeekHead rarely lists them all
+		if (nextClusterPos != 0) {
+			if (nextClusterPos == m_ClusterScanPos)
+				ExtendClusterIndex(MAX_UINT64, 1);
+			else if (m_ClusterIndex.Find(nextClusterPos) == CLUSTER_NOT_FOUND)
+				ScanClusters(nextClusterPos, MAX_UINT64, 1);
+			// Entries may have been inserted before ours
+			currentCluster = m_ClusterIndex.Find(clusterFilePos);
+		}
 		
-		if (currentCluster->clusterNo < m_ClusterIndex.size()-1) {
-			if (m_ClusterIndex.at(currentCluster->clusterNo+1)->timecode == MAX_UINT64)
-				m_ClusterIndex.at(currentCluster->clusterNo+1)->timecode = GetClusterTimecode(m_ClusterIndex.at(currentCluster->clusterNo+1)->filePos);
-			m_CurrentTimecode = m_ClusterIndex.at(currentCluster->clusterNo+1)->timecode;
+		if (currentCluster+1 < m_ClusterIndex.size()) {
+			m_CurrentTimecode = GetResolvedTimecode(currentCluster+1);
 			if(m_CurrentTimecode == 0)
 			{
-				console::error(uStringPrintf("clusterNo : %d, m_ClusterIndex.size() : %d", currentCluster->clusterNo, m_ClusterIndex.size()));
+				console::error(uStringPrintf("clusterNo : %d, m_ClusterIndex.size() : %d", currentCluster, m_ClusterIndex.size()));
 				console::info("m_CurrentTimecode == 0 (a)");
 			}
 		} else {
@@ -2229,134 +3234,586 @@ int MatroskaAudioParser::FillQueue()
 		}
 		
 	} else {
-		// Find the element data
-		ElementLevel1 = ElementPtr(m_InputStream.FindNextID(KaxCluster::ClassInfos, 0xFFFFFFFFFFFFFFFFL));
-		if (ElementLevel1 == NullElement)
-			return 1;
+		streamRet = ReadStreamBlocks();
+	}
+	DecodeFrames();
+	//NOTE1("MatroskaAudioParser::FillQueue() - Queue now has %u frames", m_Queue.size());
+	// The frames read before the stream ended are delivered first
+	if (m_Queue.empty())
+		return streamRet;
+	return 0;
+};
 
-		if (EbmlId(*ElementLevel1) == KaxCluster::ClassInfos.GlobalId) {
-			KaxCluster *SegmentCluster = static_cast<KaxCluster *>(ElementLevel1.get());
-			uint32 ClusterTimecode = 0;
+void MatroskaAudioParser::QueueFrame(MatroskaAudioFrame *newFrame, MatroskaAudioFrame *&prevFrame)
+{
+	AddEncodedFrame(newFrame);
+	m_Queue.push(newFrame);
+	if (prevFrame != NULL && prevFrame->duration == 0) {
+		prevFrame->duration = newFrame->timecode - prevFrame->timecode;
+		//if (newFrame->duration == 0)
+		//	newFrame->duration = prevFrame->duration;
+	}
 
-			// read blocks and discard the ones we don't care about
-			ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, ElementLevel1->ElementSize(), bAllowDummy));
-			while (ElementLevel2 != NullElement) {
-				if (UpperElementLevel > 0) {
-					break;
-				}
-				if (UpperElementLevel < 0) {
-					UpperElementLevel = 0;
+	// !!!!!!!!!!!!!!! HACK ALERT !!!!!!!!!!!!!!!!!!!!!!!!
+	// This is an ugly hack to keep us from re-seeking to the same cluster
+	m_CurrentTimecode = newFrame->timecode + (newFrame->duration * 2);
+	if (newFrame->duration == 0) {
+		m_CurrentTimecode += (int64)m_Tracks.at(m_CurrentTrackNo).defaultDuration * 2;
+	}
+	// !!!!!!!!!!!!!!! HACK ALERT !!!!!!!!!!!!!!!!!!!!!!!!
+
+	prevFrame = newFrame;
+}
+
+void MatroskaAudioParser::AddEncodedFrame(MatroskaAudioFrame *frame)
+{
+	if (m_Tracks.at(frame->trackNo).compressionAlgo != MATROSKA_COMPRESSION_NONE)
+		m_EncodedFrames.push_back(frame);
+}
+
+void MatroskaAudioParser::DecodeFrames()
+{
+	if (m_EncodedFrames.empty())
+		return;
+
+	// The decoded laces go after the blocks, a header stripped lace only grows by
+	// the stripped bytes so all of them are made room for at once
+	ByteArray &clusterData = m_ClusterBuffer->data;
+	size_t strippedSize = 0;
+	for (size_t f = 0; f < m_EncodedFrames.size(); f++) {
+		MatroskaAudioFrame *frame = m_EncodedFrames.at(f);
+		const MatroskaTrackInfo &track = m_Tracks.at(frame->trackNo);
+		if (track.compressionAlgo != MATROSKA_COMPRESSION_HEADER_STRIPPING)
+			continue;
+		for (uint32 l = 0; l < frame->GetLaceCount(); l++)
+			strippedSize += track.compressionSettings.size() + frame->GetLaceSize(l);
+	}
+	clusterData.reserve(clusterData.size() + strippedSize);
+
+	uint32 brokenFrames = 0;
+	for (size_t f = 0; f < m_EncodedFrames.size(); f++) {
+		MatroskaAudioFrame *frame = m_EncodedFrames.at(f);
+		const MatroskaTrackInfo &track = m_Tracks.at(frame->trackNo);
+		bool bBroken = false;
+		for (uint32 l = 0; (l < frame->GetLaceCount()) && !bBroken; l++) {
+			MatroskaLace &lace = frame->laces.at(l);
+			size_t offset = clusterData.size();
+			if (track.compressionAlgo == MATROSKA_COMPRESSION_HEADER_STRIPPING) {
+				size_t settingsSize = track.compressionSettings.size();
+				clusterData.resize(offset + settingsSize + lace.size);
+				if (settingsSize > 0)
+					memcpy(&clusterData[offset], &track.compressionSettings[0], settingsSize);
+				memcpy(&clusterData[offset + settingsSize], &clusterData[lace.offset], lace.size);
+				lace.size += static_cast<uint32>(settingsSize);
+			} else if (track.compressionAlgo == MATROSKA_COMPRESSION_ZLIB) {
+				size_t inflatedSize;
+				if (!Inflate(&clusterData[lace.offset], lace.size, inflatedSize)) {
+					bBroken = true;
+					continue;
 				}
-				if (EbmlId(*ElementLevel2) == KaxClusterTimecode::ClassInfos.GlobalId) {						
-					KaxClusterTimecode & ClusterTime = *static_cast<KaxClusterTimecode*>(ElementLevel2.get());
-					ClusterTime.ReadData(m_InputStream.I_O());
-					ClusterTimecode = uint32(ClusterTime);
-					SegmentCluster->InitTimecode(ClusterTimecode, m_TimecodeScale);
-				} else  if (EbmlId(*ElementLevel2) == KaxBlockGroup::ClassInfos.GlobalId) {
-					//KaxBlockGroup & aBlockGroup = *static_cast<KaxBlockGroup*>(ElementLevel2);
+				clusterData.resize(offset + inflatedSize);
+				if (inflatedSize > 0)
+					memcpy(&clusterData[offset], &m_InflateBuffer[0], inflatedSize);
+				lace.size = static_cast<uint32>(inflatedSize);
+			} else {
+				// Parse_Tracks() doesn't keep the tracks with other algorithms
+				bBroken = true;
+				continue;
+			}
+			if (clusterData.size() > 0xFFFFFFFF) {
+				bBroken = true;
+				continue;
+			}
+			lace.offset = static_cast<uint32>(offset);
+		}
+		if (bBroken) {
+			// Marked to be dropped below, it can't be decoded in part
+			frame->SetLaceCount(0);
+			brokenFrames++;
+		}
+	}
+	m_EncodedFrames.clear();
+	if (brokenFrames == 0)
+		return;
 
-					// Create a new frame
-					MatroskaAudioFrame *newFrame = new MatroskaAudioFrame;				
+	NOTE1("MatroskaAudioParser::DecodeFrames() - %u frames can't be decoded", brokenFrames);
+	// Only the broken frames are skipped, the rest of the cluster still plays
+	size_t queuedFrames = m_Queue.size();
+	for (size_t q = 0; q < queuedFrames; q++) {
+		MatroskaAudioFrame *frame = m_Queue.front();
+		m_Queue.pop();
+		if (frame->GetLaceCount() == 0)
+			ReleaseFrame(frame);
+		else
+			m_Queue.push(frame);
+	}
+}
 
-					ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, ElementLevel2->ElementSize(), bAllowDummy));
-					while (ElementLevel3 != NullElement) {
-						if (UpperElementLevel > 0) {
-							break;
-						}
-						if (UpperElementLevel < 0) {
-							UpperElementLevel = 0;
-						}
-						if (EbmlId(*ElementLevel3) == KaxBlock::ClassInfos.GlobalId) {								
-							KaxBlock & DataBlock = *static_cast<KaxBlock*>(ElementLevel3.get());														
-							DataBlock.ReadData(m_InputStream.I_O());		
-							DataBlock.SetParent(*SegmentCluster);
-
-							//NOTE4("Track # %u / %u frame%s / Timecode %I64d", DataBlock.TrackNum(), DataBlock.NumberFrames(), (DataBlock.NumberFrames() > 1)?"s":"", DataBlock.GlobalTimecode()/m_TimecodeScale);
-							if (DataBlock.TrackNum() == m_Tracks.at(m_CurrentTrackNo).trackNumber) {											
-								newFrame->timecode = DataBlock.GlobalTimecode();							
-
-								if (DataBlock.NumberFrames() > 1) {	
-									// The evil lacing has been used
-									newFrame->duration = m_Tracks.at(m_CurrentTrackNo).defaultDuration * DataBlock.NumberFrames();
-
-									newFrame->dataBuffer.resize(DataBlock.NumberFrames());
-									for (uint32 f = 0; f < DataBlock.NumberFrames(); f++) {
-										DataBuffer &buffer = DataBlock.GetBuffer(f);
-										newFrame->dataBuffer[f].resize(buffer.Size());								
-										memcpy(&newFrame->dataBuffer[f][0], buffer.Buffer(), buffer.Size());
-									}
-								} else {
-									// Non-lacing block		
-									newFrame->duration = m_Tracks.at(m_CurrentTrackNo).defaultDuration;
-									
-									newFrame->dataBuffer.resize(1);
-									DataBuffer &buffer = DataBlock.GetBuffer(0);
-									newFrame->dataBuffer.at(0).resize(buffer.Size());								
-									memcpy(&newFrame->dataBuffer[0][0], buffer.Buffer(), buffer.Size());
-								}
-							} else {
-								//newFrame->timecode = MAX_UINT64;
-							}
-						/*
-						} else if (EbmlId(*ElementLevel3) == KaxReferenceBlock::ClassInfos.GlobalId) {
-							KaxReferenceBlock & RefTime = *static_cast<KaxReferenceBlock*>(ElementLevel3);
-							RefTime.ReadData(m_InputStream.I_O());
-							newFrame->frameReferences.push_back(int32(RefTime));
-							//wxLogDebug("  Reference frame at scaled (%d) timecode %ld\n", int32(RefTime), int32(int64(RefTime) * TimecodeScale));
-							*/
-						} else if (EbmlId(*ElementLevel3) == KaxBlockDuration::ClassInfos.GlobalId) {
-							KaxBlockDuration & BlockDuration = *static_cast<KaxBlockDuration*>(ElementLevel3.get());
-							BlockDuration.ReadData(m_InputStream.I_O());
-							newFrame->duration = uint64(BlockDuration);
-						}
-						if (UpperElementLevel > 0) {
-							UpperElementLevel--;
-							//delete ElementLevel3;
-							//_DELETE(ElementLevel3);
-							ElementLevel3 = ElementLevel4;
-							if (UpperElementLevel > 0)
-								break;
-						} else {
-							ElementLevel3->SkipData(m_InputStream, ElementLevel3->Generic().Context);
-							//delete ElementLevel3;
-							//ElementLevel3 = NULL;
-							//_DELETE(ElementLevel3);
+/// Largest frame Inflate() accepts
+#define MAX_INFLATED_SIZE (64 * 1024 * 1024)
 
-							ElementLevel3 = ElementPtr(m_InputStream.FindNextElement(ElementLevel2->Generic().Context, UpperElementLevel, ElementLevel2->ElementSize(), bAllowDummy));
-						}							
-						//newFrame = new MatroskaReadFrame();
+bool MatroskaAudioParser::Inflate(const binary *data, size_t size, size_t &outSize)
+{
+	if (!m_InflateReady) {
+		memset(&m_InflateStream, 0, sizeof(m_InflateStream));
+		if (inflateInit(&m_InflateStream) != Z_OK)
+			return false;
+		m_InflateReady = true;
+	} else if (inflateReset(&m_InflateStream) != Z_OK) {
+		return false;
+	}
+
+	// m_InflateBuffer only grows, it soon fits every frame of the file
+	if (m_InflateBuffer.size() < size * 2 + 1024)
+		m_InflateBuffer.resize(size * 2 + 1024);
+	m_InflateStream.next_in = const_cast<Bytef *>(data);
+	m_InflateStream.avail_in = static_cast<uInt>(size);
+	outSize = 0;
+	for (;;) {
+		m_InflateStream.next_out = &m_InflateBuffer[outSize];
+		m_InflateStream.avail_out = static_cast<uInt>(m_InflateBuffer.size() - outSize);
+		int result = inflate(&m_InflateStream, Z_FINISH);
+		outSize = m_InflateBuffer.size() - m_InflateStream.avail_out;
+		if (result == Z_STREAM_END)
+			return true;
+		// Anything but a full output buffer means the data is broken
+		if (((result != Z_OK) && (result != Z_BUF_ERROR)) || (m_InflateStream.avail_out != 0))
+			return false;
+		if (m_InflateBuffer.size() >= MAX_INFLATED_SIZE)
+			return false;
+		m_InflateBuffer.resize(m_InflateBuffer.size() * 2);
+	}
+}
+
+/// Reads the lace sizes of a block
+/// \param pos Offset of the lacing header, after the track number, timecode and flags
+/// \return Offset of the first frame, 0 if the lacing is broken
+static size_t ReadBlockLacing(const binary *data, size_t size, size_t pos, binary flags, std::vector<uint32> &laceSizes)
+{
+	laceSizes.clear();
+	binary lacing = (flags >> 1) & 0x03;
+	if (lacing == 0) {
+		laceSizes.push_back(static_cast<uint32>(size - pos));
+		return pos;
+	}
+
+	if (pos >= size)
+		return 0;
+	size_t laceCount = data[pos++] + 1;
+	uint64 total = 0;
+	if (lacing == 1) {
+		// Xiph lacing, each size is a run of 255s ended by a smaller byte
+		for (size_t l = 0; l + 1 < laceCount; l++) {
+			uint32 laceSize = 0;
+			binary sizeByte;
+			do {
+				if (pos >= size)
+					return 0;
+				sizeByte = data[pos++];
+				laceSize += sizeByte;
+			} while (sizeByte == 0xFF);
+			laceSizes.push_back(laceSize);
+			total += laceSize;
+		}
+	} else if (lacing == 3) {
+		// EBML lacing, the first size then signed differences with the previous one
+		uint64 value;
+		bool sizeUnknown;
+		int64 laceSize = 0;
+		for (size_t l = 0; l + 1 < laceCount; l++) {
+			unsigned int length = ReadEbmlCodedSize(data + pos, size - pos, value, sizeUnknown);
+			if (length == 0)
+				return 0;
+			pos += length;
+			if (l == 0)
+				laceSize = static_cast<int64>(value);
+			else
+				laceSize += static_cast<int64>(value) - ((static_cast<int64>(1) << (7 * length - 1)) - 1);
+			if (laceSize < 0)
+				return 0;
+			laceSizes.push_back(static_cast<uint32>(laceSize));
+			total += laceSize;
+		}
+	} else {
+		// Fixed-size lacing
+		if ((size - pos) % laceCount)
+			return 0;
+		for (size_t l = 0; l + 1 < laceCount; l++) {
+			laceSizes.push_back(static_cast<uint32>((size - pos) / laceCount));
+			total += (size - pos) / laceCount;
+		}
+	}
+
+	if (pos + total > size)
+		return 0;
+	laceSizes.push_back(static_cast<uint32>(size - pos - total));
+	return pos;
+}
+
+/// Cluster buffers kept for reuse, the frame ring rarely spans more clusters
+#define CLUSTER_BUFFER_POOL_SIZE 8
+
+void MatroskaAudioParser::PrepareClusterBuffer()
+{
+	// Reuse the buffer of the previous cluster once no frame points into it anymore
+	if ((m_ClusterBuffer.get() == NULL) || (m_ClusterBuffer->refCount > 1)) {
+		cluster_buffer_ptr previous;
+		previous.swap(m_ClusterBuffer);
+		// A pooled buffer only referenced by the pool is free, frames are
+		// released on the decoding thread but never take a new reference
+		for (size_t b = 0; b < m_ClusterBufferPool.size(); b++) {
+			if (m_ClusterBufferPool.at(b)->refCount == 1) {
+				m_ClusterBuffer.swap(m_ClusterBufferPool.at(b));
+				m_ClusterBufferPool.erase(m_ClusterBufferPool.begin() + b);
+				break;
+			}
+		}
+		if (m_ClusterBuffer.get() == NULL) {
+			m_ClusterBuffer = cluster_buffer_ptr(new MatroskaClusterBuffer());
+			m_ClusterBufferMisses++;
+		}
+		if ((previous.get() != NULL) && (m_ClusterBufferPool.size() < CLUSTER_BUFFER_POOL_SIZE))
+			m_ClusterBufferPool.push_back(previous);
+	}
+	m_ClusterBuffer->data.clear();
+}
+
+bool MatroskaAudioParser::ReadBlock(EbmlElement &block, uint32 clusterTimecode, MatroskaAudioFrame &frame, bool simpleBlock)
+{
+	if (!block.IsFiniteSize() || block.GetSize() < 4 || block.GetSize() > 0x7FFFFFFF)
+		return false;
+	if (m_IOCallback.seekable() && !IsCurrentTrackBlock(block))
+		return false;
+
+	// The block is read in one go at the end of the cluster buffer, no
+	// element tree is built for it and the frame only keeps offsets into it
+	ByteArray &clusterData = m_ClusterBuffer->data;
+	size_t offset = clusterData.size();
+	size_t size = static_cast<size_t>(block.GetSize());
+	clusterData.resize(offset + size);
+	if ((m_IOCallback.read(&clusterData[offset], size) != size)
+		|| !ParseBlock(offset, size, clusterTimecode, frame, simpleBlock))
+	{
+		clusterData.resize(offset);
+		return false;
+	}
+	return true;
+}
+
+bool MatroskaAudioParser::ParseBlock(size_t offset, size_t size, uint32 clusterTimecode, MatroskaAudioFrame &frame, bool simpleBlock)
+{
+	const binary *data = &m_ClusterBuffer->data[offset];
+	uint64 trackNumber;
+	bool sizeUnknown;
+	size_t pos = ReadEbmlCodedSize(data, size, trackNumber, sizeUnknown);
+	if ((pos == 0) || (pos + 3 > size) || (trackNumber != m_Tracks.at(m_CurrentTrackNo).trackNumber))
+		return false;
+	int16 relativeTimecode = static_cast<int16>((data[pos] << 8) | data[pos+1]);
+	binary flags = data[pos+2];
+	pos = ReadBlockLacing(data, size, pos + 3, flags, m_LaceSizes);
+	if (pos == 0)
+		return false;
+
+	frame.timecode = (static_cast<int64>(clusterTimecode) + relativeTimecode) * m_TimecodeScale;
+	// Only SimpleBlock has a keyframe flag
+	frame.keyframe = !simpleBlock || ((flags & 0x80) != 0);
+	frame.trackNo = m_CurrentTrackNo;
+	frame.duration = m_Tracks.at(m_CurrentTrackNo).defaultDuration * m_LaceSizes.size();
+	frame.buffer = m_ClusterBuffer;
+	frame.SetLaceCount(static_cast<uint32>(m_LaceSizes.size()));
+	pos += offset;
+	for (size_t f = 0; f < m_LaceSizes.size(); f++) {
+		frame.laces[f].offset = static_cast<uint32>(pos);
+		frame.laces[f].size = m_LaceSizes[f];
+		pos += m_LaceSizes[f];
+	}
+	return true;
+}
+
+bool MatroskaAudioParser::ParseBlockGroup(size_t offset, size_t size, uint32 clusterTimecode, MatroskaAudioFrame &frame)
+{
+	EbmlElementHeader groupChild;
+	EbmlMemoryWalker groupWalker(&m_ClusterBuffer->data[offset], size);
+	while (groupWalker.Next(groupChild)) {
+		if (groupChild.id == KaxBlock::ClassInfos.GlobalId.Value) {
+			ParseBlock(offset + groupWalker.GetDataPos(), static_cast<size_t>(groupChild.size), clusterTimecode, frame, false);
+		} else if (groupChild.id == KaxBlockDuration::ClassInfos.GlobalId.Value) {
+			frame.duration = ReadEbmlUInteger(groupWalker.GetData(), groupChild.size);
+		} else if (groupChild.id == KaxBlockAdditions::ClassInfos.GlobalId.Value) {
+			EbmlElementHeader moreHeader;
+			EbmlMemoryWalker additionsWalker(groupWalker.GetData(), static_cast<size_t>(groupChild.size));
+			while (additionsWalker.Next(moreHeader)) {
+				if (moreHeader.id != KaxBlockMore::ClassInfos.GlobalId.Value)
+					continue;
+				EbmlElementHeader moreChild;
+				EbmlMemoryWalker moreWalker(additionsWalker.GetData(), static_cast<size_t>(moreHeader.size));
+				while (moreWalker.Next(moreChild)) {
+					if (moreChild.id == KaxBlockAddID::ClassInfos.GlobalId.Value) {
+						frame.add_id = ReadEbmlUInteger(moreWalker.GetData(), moreChild.size);
+					} else if (moreChild.id == KaxBlockAdditional::ClassInfos.GlobalId.Value) {
+						frame.additional_data_buffer.assign(moreWalker.GetData(), moreWalker.GetData() + moreChild.size);
+						if (!frame.add_id)
+							frame.add_id = 1;
 					}
-					if (newFrame->dataBuffer.size()>0)
-						m_Queue.push(newFrame);
 				}
+			}
+		}
+	}
+	return frame.GetLaceCount() > 0;
+}
 
-				if (UpperElementLevel > 0) {
-					UpperElementLevel--;
-					//delete ElementLevel2;
-					//_DELETE(ElementLevel2);
-					ElementLevel2 = ElementLevel3;
-					if (UpperElementLevel > 0)
-						break;
-				} else {
-					ElementLevel2->SkipData(m_InputStream, ElementLevel2->Generic().Context);
-					//if (ElementLevel2 != pChecksum)
-					//	delete ElementLevel2;								
-					//ElementLevel2 = NULL;
-					//_DELETE(ElementLevel2);
+/// Clusters larger than this are read element by element
+#define MAX_CLUSTER_READ_SIZE (32 * 1024 * 1024)
+
+bool MatroskaAudioParser::ReadClusterFromMemory(size_t cluster, uint64 blockStartOffset, uint64 &nextClusterPos)
+{
+	const uint64 clusterPos = m_ClusterIndex.GetPosition(cluster);
+	binary headerBuffer[EBML_MAX_HEADER_SIZE];
+	m_IOCallback.setFilePointer(clusterPos);
+	uint32 headerSize = m_IOCallback.read(headerBuffer, sizeof(headerBuffer));
+	EbmlElementHeader clusterHeader;
+	if (!ReadEbmlElementHeader(headerBuffer, headerSize, clusterHeader)
+		|| (clusterHeader.id != KaxCluster::ClassInfos.GlobalId.Value)
+		|| clusterHeader.sizeUnknown
+		|| (clusterHeader.size > MAX_CLUSTER_READ_SIZE))
+	{
+		return false;
+	}
+
+	// The whole cluster in a single read
+	ByteArray &clusterData = m_ClusterBuffer->data;
+	size_t size = static_cast<size_t>(clusterHeader.size);
+	clusterData.resize(size);
+	if (size > 0) {
+		m_IOCallback.setFilePointer(clusterPos + clusterHeader.headSize);
+		if (m_IOCallback.read(&clusterData[0], size) != size) {
+			clusterData.clear();
+			return false;
+		}
+	}
+	nextClusterPos = clusterPos + clusterHeader.headSize + clusterHeader.size;
+	if (size == 0)
+		return true;
 
-					ElementLevel2 = ElementPtr(m_InputStream.FindNextElement(ElementLevel1->Generic().Context, UpperElementLevel, ElementLevel1->ElementSize(), bAllowDummy));
+	const uint32 SimpleBlockId = 0xA3;
+	uint32 clusterTimecode = 0;
+	MatroskaAudioFrame *prevFrame = NULL;
+	std::vector<MatroskaBlockOffset> blockOffsets;
+	bool bRecordOffsets = (blockStartOffset == 0) && (m_BlockOffsets.find(clusterPos) == m_BlockOffsets.end());
+	EbmlElementHeader child;
+	EbmlMemoryWalker clusterWalker(&clusterData[0], size);
+	while (clusterWalker.Next(child)) {
+		MatroskaBlockOffset blockOffset = { 0, clusterWalker.GetDataPos() - child.headSize };
+		if (child.id == KaxClusterTimecode::ClassInfos.GlobalId.Value) {
+			clusterTimecode = static_cast<uint32>(ReadEbmlUInteger(clusterWalker.GetData(), child.size));
+			m_ClusterIndex.SetTimecode(cluster, clusterTimecode * m_TimecodeScale);
+		} else if (blockOffset.offset < blockStartOffset) {
+			// Seeking inside the cluster, the blocks before are not parsed
+		} else if (child.id == SimpleBlockId) {
+			MatroskaAudioFrame *newFrame = NewFrame();
+			if (ParseBlock(clusterWalker.GetDataPos(), static_cast<size_t>(child.size), clusterTimecode, *newFrame, true)) {
+				if (bRecordOffsets) {
+					blockOffset.timecode = newFrame->timecode;
+					blockOffsets.push_back(blockOffset);
+				}
+				QueueFrame(newFrame, prevFrame);
+			} else {
+				ReleaseFrame(newFrame);
+			}
+		} else if (child.id == KaxBlockGroup::ClassInfos.GlobalId.Value) {
+			MatroskaAudioFrame *newFrame = NewFrame();
+			if (ParseBlockGroup(clusterWalker.GetDataPos(), static_cast<size_t>(child.size), clusterTimecode, *newFrame)) {
+				if (bRecordOffsets) {
+					blockOffset.timecode = newFrame->timecode;
+					blockOffsets.push_back(blockOffset);
 				}
+				QueueFrame(newFrame, prevFrame);
+			} else {
+				ReleaseFrame(newFrame);
 			}
 		}
-		ElementLevel1->SkipData(m_InputStream, ElementLevel1->Generic().Context);
-		//_DELETE(ElementLevel3);
-		//_DELETE(ElementLevel2);
-		//_DELETE(ElementLevel1);
-		//delete ElementLevel1;
 	}
-	//NOTE1("MatroskaAudioParser::FillQueue() - Queue now has %u frames", m_Queue.size());
+	if (bRecordOffsets)
+		AddBlockOffsets(clusterPos, blockOffsets);
+	return true;
+}
+
+/// An element that can't be the child of a cluster, it ends a cluster of unknown size
+static bool IsLevel1Id(uint32 id)
+{
+	return (id == KaxCluster::ClassInfos.GlobalId.Value)
+		|| (id == KaxCues::ClassInfos.GlobalId.Value)
+		|| (id == KaxTags::ClassInfos.GlobalId.Value)
+		|| (id == KaxChapters::ClassInfos.GlobalId.Value)
+		|| (id == KaxAttachments::ClassInfos.GlobalId.Value)
+		|| (id == KaxSeekHead::ClassInfos.GlobalId.Value)
+		|| (id == KaxInfo::ClassInfos.GlobalId.Value)
+		|| (id == KaxTracks::ClassInfos.GlobalId.Value)
+		// A chained stream starts over with a new EBML header and segment
+		|| (id == KaxSegment::ClassInfos.GlobalId.Value)
+		|| (id == EbmlHead::ClassInfos.GlobalId.Value);
+}
+
+/// Block data a single ReadStreamBlocks() keeps at most, so a long cluster
+/// of a live stream is handed over in parts
+#define STREAM_MAX_BUFFER_SIZE (1024 * 1024)
+
+int MatroskaAudioParser::ReadStreamBlocks()
+{
+	const uint32 SimpleBlockId = 0xA3;
+	ByteArray &clusterData = m_ClusterBuffer->data;
+	EbmlElementHeader header;
+	MatroskaAudioFrame *prevFrame = NULL;
+
+	while (clusterData.size() < STREAM_MAX_BUFFER_SIZE) {
+		if (m_StreamInCluster && (m_StreamReader.GetPosition() >= m_StreamClusterEnd)) {
+			m_StreamInCluster = false;
+			return 0;
+		}
+		if (!m_StreamReader.PeekElementHeader(header))
+			// The end of the stream, or garbage we can't find our way through
+			return 2;
+
+		if (!m_StreamInCluster) {
+			if (header.id == KaxCluster::ClassInfos.GlobalId.Value) {
+				m_StreamReader.Skip(header.headSize);
+				m_StreamInCluster = true;
+				m_StreamClusterTimecode = 0;
+				m_StreamClusterEnd = header.sizeUnknown ? MAX_UINT64 : m_StreamReader.GetPosition() + header.size;
+			} else if (header.id == KaxSegment::ClassInfos.GlobalId.Value) {
+				// The level 1 elements of the next segment follow
+				m_StreamReader.Skip(header.headSize);
+			} else if (header.sizeUnknown) {
+				return 1;
+			} else if (m_StreamReader.Skip(header.headSize + header.size) < header.headSize + header.size) {
+				return 2;
+			}
+			continue;
+		}
+
+		if (IsLevel1Id(header.id)) {
+			// The end of a cluster of unknown size
+			m_StreamInCluster = false;
+			return 0;
+		}
+		if (header.sizeUnknown)
+			return 1;
+
+		if (header.id == KaxClusterTimecode::ClassInfos.GlobalId.Value) {
+			if (m_StreamReader.Fill(header.headSize + static_cast<size_t>(header.size)) < header.headSize + header.size)
+				return 2;
+			m_StreamClusterTimecode = static_cast<uint32>(ReadEbmlUInteger(m_StreamReader.Peek() + header.headSize, header.size));
+			m_StreamReader.Skip(header.headSize + header.size);
+
+		} else if (((header.id == SimpleBlockId) || (header.id == KaxBlockGroup::ClassInfos.GlobalId.Value))
+			&& (header.size <= MAX_CLUSTER_READ_SIZE))
+		{
+			m_StreamReader.Skip(header.headSize);
+			size_t offset = clusterData.size();
+			size_t size = static_cast<size_t>(header.size);
+			clusterData.resize(offset + size);
+			if (m_StreamReader.Read(size > 0 ? &clusterData[offset] : NULL, size) < size) {
+				clusterData.resize(offset);
+				return 2;
+			}
+			MatroskaAudioFrame *newFrame = NewFrame();
+			bool bParsed;
+			if (header.id == SimpleBlockId)
+				bParsed = ParseBlock(offset, size, m_StreamClusterTimecode, *newFrame, true);
+			else
+				bParsed = ParseBlockGroup(offset, size, m_StreamClusterTimecode, *newFrame);
+			if (!bParsed) {
+				// Another track, its data is dropped right away
+				ReleaseFrame(newFrame);
+				clusterData.resize(offset);
+				continue;
+			}
+			QueueFrame(newFrame, prevFrame);
+
+		} else if (m_StreamReader.Skip(header.headSize + header.size) < header.headSize + header.size) {
+			return 2;
+		}
+	}
 	return 0;
-};
+}
+
+uint64 MatroskaAudioParser::FindBlockOffset(size_t cluster, uint64 timecode)
+{
+	uint64 clusterPos = m_ClusterIndex.GetPosition(cluster);
+
+	std::map<uint64, std::vector<MatroskaBlockOffset> >::const_iterator blocks = m_BlockOffsets.find(clusterPos);
+	if (blocks != m_BlockOffsets.end()) {
+		// The blocks are in file order
+		uint64 offset = 0;
+		for (size_t b = 0; b < blocks->second.size(); b++) {
+			if (blocks->second.at(b).timecode > timecode)
+				break;
+			offset = blocks->second.at(b).offset;
+		}
+		return offset;
+	}
+
+	// A cue point of our track in this cluster, if the muxer wrote CueRelativePosition
+	const MatroskaCuePoint *cuePoint = FindCuePoint(timecode);
+	if ((cuePoint == NULL) || (cuePoint->relativePos == 0) || (cuePoint->clusterPos != clusterPos)
+		|| (cuePoint->track != m_Tracks.at(m_CurrentTrackNo).trackNumber))
+		return 0;
+	try {
+		// Only trust it if there is a block at this position
+		binary buffer[EBML_MAX_HEADER_SIZE];
+		EbmlElementHeader clusterHeader;
+		m_IOCallback.setFilePointer(clusterPos);
+		uint32 bufferSize = m_IOCallback.read(buffer, sizeof(buffer));
+		if (!ReadEbmlElementHeader(buffer, bufferSize, clusterHeader)
+			|| (!clusterHeader.sizeUnknown && (cuePoint->relativePos >= clusterHeader.size)))
+			return 0;
+		EbmlElementHeader blockHeader;
+		m_IOCallback.setFilePointer(clusterPos + clusterHeader.headSize + cuePoint->relativePos);
+		bufferSize = m_IOCallback.read(buffer, sizeof(buffer));
+		if (ReadEbmlElementHeader(buffer, bufferSize, blockHeader) && !blockHeader.sizeUnknown
+			&& ((blockHeader.id == 0xA3) || (blockHeader.id == KaxBlockGroup::ClassInfos.GlobalId.Value)))
+		{
+			NOTE2("MatroskaAudioParser::FindBlockOffset(timecode = %u) cued block at %u", (uint32)(timecode / m_TimecodeScale), (uint32)cuePoint->relativePos);
+			return cuePoint->relativePos;
+		}
+	} catch (...) {
+	}
+	return 0;
+}
+
+/// Clusters whose block offsets are kept
+#define BLOCK_OFFSET_MAX_CLUSTERS 256
+
+void MatroskaAudioParser::AddBlockOffsets(uint64 clusterPos, std::vector<MatroskaBlockOffset> &blockOffsets)
+{
+	if (blockOffsets.empty())
+		return;
+	if (m_BlockOffsets.size() >= BLOCK_OFFSET_MAX_CLUSTERS)
+		// Start over rather than track which clusters were used last
+		m_BlockOffsets.clear();
+	m_BlockOffsets[clusterPos].swap(blockOffsets);
+}
+
+bool MatroskaAudioParser::IsCurrentTrackBlock(EbmlElement &block)
+{
+	// The block data starts with the track number as an EBML coded size
+	binary buffer[8];
+	uint64 dataPos = block.GetElementPosition() + block.HeadSize();
+	uint32 readSize = sizeof(buffer);
+	if (block.GetSize() < readSize)
+		readSize = static_cast<uint32>(block.GetSize());
+
+	m_IOCallback.setFilePointer(dataPos);
+	uint32 bytesRead = m_IOCallback.read(buffer, readSize);
+	m_IOCallback.setFilePointer(dataPos);
+
+	uint64 trackNumber;
+	bool sizeUnknown;
+	if (ReadEbmlCodedSize(buffer, bytesRead, trackNumber, sizeUnknown) == 0)
+		// Let ReadData() deal with it
+		return true;
+	return trackNumber == m_Tracks.at(m_CurrentTrackNo).trackNumber;
+}
 
 uint64 MatroskaAudioParser::GetClusterTimecode(uint64 filePos) {	
 	try {
@@ -2425,117 +3882,498 @@ uint64 MatroskaAudioParser::GetClusterTimecode(uint64 filePos) {
 	}	
 };
 
-cluster_entry_ptr MatroskaAudioParser::FindCluster(uint64 timecode)
+/// Clusters resolved by one ResolveClusterTimecodes() sweep
+#define CLUSTER_RESOLVE_BATCH 32
+
+size_t MatroskaAudioParser::FindCluster(uint64 timecode)
 {
 	try {
 		#ifdef _DEBUG_NO_SEEKING
 		static size_t callCount = 0;
 		if (callCount < m_ClusterIndex.size())
-			return &m_ClusterIndex[callCount++];
-		else return NULL;
+			return callCount++;
+		else return CLUSTER_NOT_FOUND;
 		#endif
 
+		if (m_ClusterIndex.empty() || (timecode == MAX_UINT64))
+			// FillQueue went past the last cluster
+			return CLUSTER_NOT_FOUND;
+
 		if (timecode == 0)
 			// Special case
-			return m_ClusterIndex.at(0);
-		
-		cluster_entry_ptr correctEntry;
-		double clusterDuration = (double)(int64)m_ClusterIndex.size() / m_Duration;
-		size_t clusterIndex = clusterDuration * (double)(int64)timecode;
-		//int lookCount = 0;
-		if (clusterIndex > m_ClusterIndex.size())
-			clusterIndex = m_ClusterIndex.size()-1;
-
-		cluster_entry_ptr clusterEntry;
-		cluster_entry_ptr prevClusterEntry;
-		cluster_entry_ptr nextClusterEntry;
-		while (correctEntry == NULL) {
-			clusterEntry = m_ClusterIndex.at(clusterIndex);		
-			if (clusterIndex > 0)
-				prevClusterEntry = m_ClusterIndex.at(clusterIndex-1);
-			if (clusterIndex+1 < m_ClusterIndex.size())
-				nextClusterEntry = m_ClusterIndex.at(clusterIndex+1);			
-			
-			// We need timecodes to do good seeking
-			if (clusterEntry->timecode == MAX_UINT64) {				
-				clusterEntry->timecode = GetClusterTimecode(clusterEntry->filePos);			
-			}
-			if (prevClusterEntry != NULL && prevClusterEntry->timecode == MAX_UINT64) {
-				prevClusterEntry->timecode = GetClusterTimecode(prevClusterEntry->filePos);			
-			}
-			if (nextClusterEntry != NULL && nextClusterEntry->timecode == MAX_UINT64) {				
-				nextClusterEntry->timecode = GetClusterTimecode(nextClusterEntry->filePos);			
+			return 0;
+
+		// Without cues, scan the clusters until the index reaches timecode
+		if (m_CueIndex.empty() && (m_ClusterScanTimecode <= timecode))
+			ExtendClusterIndex(timecode, 0xFFFFFFFF);
+
+		if (!m_CueIndex.empty()) {
+			size_t cueCluster = FindClusterByCue(timecode);
+			if (cueCluster != CLUSTER_NOT_FOUND)
+				return cueCluster;
+		}
+
+		size_t correctCluster = FindClusterByTimecode(timecode);
+		if (correctCluster != CLUSTER_NOT_FOUND)
+			NOTE3("MatroskaAudioParser::FindCluster(timecode = %u) seeking to cluster %i at %u", (uint32)(timecode / m_TimecodeScale), (uint32)correctCluster, (uint32)m_ClusterIndex.GetPosition(correctCluster));
+		else
+			NOTE1("MatroskaAudioParser::FindCluster(timecode = %u) seeking failed", (uint32)(timecode / m_TimecodeScale));
+
+		return correctCluster;
+	} catch (...) {
+		return CLUSTER_NOT_FOUND;
+	}
+}
+
+size_t MatroskaAudioParser::FindClusterByTimecode(uint64 timecode)
+{
+	// Last cluster starting at or before timecode. Cluster timecodes grow with
+	// their position, a cluster we can't read the timecode of counts as later.
+	size_t low = 0;
+	size_t high = m_ClusterIndex.size();
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		uint64 middleTimecode = GetResolvedTimecode(middle);
+		if (middleTimecode != MAX_UINT64 && middleTimecode <= timecode)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == 0)
+		// timecode is before the first cluster
+		return 0;
+
+	size_t cluster = low - 1;
+	if ((cluster+1 == m_ClusterIndex.size()) && (m_Duration != 0) && (timecode > m_Duration))
+		// Past the end of the last cluster, only known with a duration
+		return CLUSTER_NOT_FOUND;
+	return cluster;
+}
+
+uint64 MatroskaAudioParser::GetResolvedTimecode(size_t cluster)
+{
+	if (m_ClusterIndex.GetTimecode(cluster) == MAX_UINT64) {
+		// The clusters around this one are resolved together, the next probes are likely close
+		size_t first = (cluster > CLUSTER_RESOLVE_BATCH / 2) ? cluster - CLUSTER_RESOLVE_BATCH / 2 : 0;
+		ResolveClusterTimecodes(first, first + CLUSTER_RESOLVE_BATCH);
+	}
+	return m_ClusterIndex.GetTimecode(cluster);
+}
+
+uint64 MatroskaAudioParser::ReadClusterHeadTimecode(const binary *buffer, size_t bufferSize, const EbmlElementHeader &header)
+{
+	// Muxers write the cluster Timecode first, so it comes with the cluster header
+	EbmlElementHeader child;
+	if (ReadEbmlElementHeader(buffer + header.headSize, bufferSize - header.headSize, child)
+		&& (child.id == KaxClusterTimecode::ClassInfos.GlobalId.Value)
+		&& (header.headSize + child.headSize + child.size <= bufferSize))
+	{
+		return ReadEbmlUInteger(buffer + header.headSize + child.headSize, child.size) * m_TimecodeScale;
+	}
+	return MAX_UINT64;
+}
+
+void MatroskaAudioParser::ResolveClusterTimecodes(size_t first, size_t last, uint64 stopTimecode)
+{
+	// Room for the cluster header and its Timecode child
+	binary buffer[2 * EBML_MAX_HEADER_SIZE + 8];
+
+	if (last > m_ClusterIndex.size())
+		last = m_ClusterIndex.size();
+	// The index is sorted by position, so this is one forward sweep and
+	// clusters close to each other share the read-ahead window
+	for (size_t c = first; c < last; c++) {
+		uint64 clusterPos = m_ClusterIndex.GetPosition(c);
+		uint64 clusterTimecode = m_ClusterIndex.GetTimecode(c);
+		if (clusterTimecode == MAX_UINT64) {
+			try {
+				m_IOCallback.setFilePointer(clusterPos);
+				uint32 bufferSize = m_IOCallback.read(buffer, sizeof(buffer));
+				EbmlElementHeader header;
+				if (ReadEbmlElementHeader(buffer, bufferSize, header) && (header.id == KaxCluster::ClassInfos.GlobalId.Value))
+					clusterTimecode = ReadClusterHeadTimecode(buffer, bufferSize, header);
+			} catch (...) {
 			}
+			if (clusterTimecode == MAX_UINT64)
+				// The Timecode is further in the cluster
+				clusterTimecode = GetClusterTimecode(clusterPos);
+			m_ClusterIndex.SetTimecode(c, clusterTimecode);
+		}
+		if ((clusterTimecode != MAX_UINT64) && (clusterTimecode > stopTimecode))
+			break;
+	}
+}
 
-			if (clusterEntry->timecode == timecode) {
-				// WOW, we are seeking directly to this cluster
-				correctEntry = clusterEntry;
-				break;
+uint64 MatroskaAudioParser::ScanClusters(uint64 filePos, uint64 timecode, uint32 maxClusters, uint64 *lastTimecode)
+{
+	// Room for the cluster header and its Timecode child
+	binary buffer[2 * EBML_MAX_HEADER_SIZE + 8];
+	uint32 clusterCount = 0;
+
+	try {
+		while ((filePos < m_SegmentEnd) && (clusterCount < maxClusters)) {
+			m_IOCallback.setFilePointer(filePos);
+			uint32 readSize = sizeof(buffer);
+			if (m_SegmentEnd - filePos < readSize)
+				readSize = static_cast<uint32>(m_SegmentEnd - filePos);
+			uint32 bufferSize = m_IOCallback.read(buffer, readSize);
+
+			EbmlElementHeader header;
+			if (!ReadEbmlElementHeader(buffer, bufferSize, header))
+				return m_SegmentEnd;
+			uint64 nextPos;
+			if (!header.sizeUnknown) {
+				nextPos = filePos + header.headSize + header.size;
+			} else if (header.id == KaxCluster::ClassInfos.GlobalId.Value) {
+				// Live recorders leave every cluster size unknown, the next cluster ends it
+				nextPos = FindNextCluster(filePos + header.headSize);
+			} else {
+				// We can't walk any further without a size to skip by
+				return m_SegmentEnd;
 			}
 
-			if (prevClusterEntry != NULL) {
-				if (clusterEntry->timecode > timecode && timecode > prevClusterEntry->timecode) {
-					// We found it !!!
-					correctEntry = prevClusterEntry;
+			if (header.id == KaxCluster::ClassInfos.GlobalId.Value) {
+				uint64 clusterTimecode = ReadClusterHeadTimecode(buffer, bufferSize, header);
+				m_ClusterIndex.Insert(filePos, clusterTimecode);
+				clusterCount++;
+				if (lastTimecode != NULL && clusterTimecode != MAX_UINT64)
+					*lastTimecode = clusterTimecode;
+				if (clusterTimecode != MAX_UINT64 && clusterTimecode > timecode) {
+					filePos = nextPos;
 					break;
 				}
-				if (prevClusterEntry->timecode == timecode) {
-					// WOW, we are seeking directly to this cluster
-					correctEntry = prevClusterEntry;
+			}
+			filePos = nextPos;
+		}
+	} catch (exception_aborted &) {
+		// The prefetch thread is stopping, the next scan starts over from m_ClusterScanPos
+		throw;
+	} catch (...) {
+		return m_SegmentEnd;
+	}
+	return filePos;
+}
+
+/// Size of the reads looking for the end of a cluster of unknown size
+#define CLUSTER_ID_SCAN_SIZE (64 * 1024)
+
+uint64 MatroskaAudioParser::FindNextCluster(uint64 filePos)
+{
+	// Room for a cluster header and its Timecode child past the end of the read
+	const size_t overlap = 2 * EBML_MAX_HEADER_SIZE + 8;
+	std::vector<binary> buffer(CLUSTER_ID_SCAN_SIZE);
+
+	try {
+		while (filePos < m_SegmentEnd) {
+			size_t readSize = buffer.size();
+			if (m_SegmentEnd - filePos < readSize)
+				readSize = static_cast<size_t>(m_SegmentEnd - filePos);
+			m_IOCallback.setFilePointer(filePos);
+			size_t bufferSize = m_IOCallback.read(&buffer[0], readSize);
+			if (bufferSize == 0)
+				break;
+
+			size_t offset = FindEbmlId(&buffer[0], bufferSize, KaxCluster::ClassInfos.GlobalId.Value);
+			while (offset < bufferSize) {
+				if (bufferSize - offset < overlap && filePos + bufferSize < m_SegmentEnd)
+					// Read again with the whole header
 					break;
-				}
-				// Check if we overshot the needed cluster
-				if (timecode < prevClusterEntry->timecode) {
-					clusterIndex--;
-					//lookCount++; // This is how many times we have 'looked'
-					continue;
-				}
+				// The ID bytes can as well be block data, a cluster starts with its Timecode
+				EbmlElementHeader header;
+				if (ReadEbmlElementHeader(&buffer[offset], bufferSize - offset, header)
+					&& (ReadClusterHeadTimecode(&buffer[offset], bufferSize - offset, header) != MAX_UINT64))
+					return filePos + offset;
+				offset = FindEbmlId(&buffer[0], bufferSize, KaxCluster::ClassInfos.GlobalId.Value, offset + 1);
 			}
-			
-			if (nextClusterEntry != NULL) {
-				if (clusterEntry->timecode < timecode && timecode < nextClusterEntry->timecode) {
-					// We found it !!!
-					correctEntry = clusterEntry;
+
+			if (bufferSize <= overlap)
+				break;
+			filePos += (offset < bufferSize) ? offset : bufferSize - overlap;
+		}
+	} catch (exception_aborted &) {
+		throw;
+	} catch (...) {
+	}
+	return m_SegmentEnd;
+}
+
+uint64 MatroskaAudioParser::ScanForElement(uint32 id, uint64 maxRange)
+{
+	uint64 minPos = static_cast<KaxSegment *>(m_ElementLevel0.get())->GetGlobalPosition(0);
+	uint64 endPos = m_FileSize;
+	uint64 range = m_TagScanRange;
+	bool bCutRange = false;
+	std::vector<binary> buffer;
+
+	try {
+		while ((endPos > minPos) && (range > 0)) {
+			uint64 startPos = (endPos - minPos > range) ? endPos - range : minPos;
+			buffer.resize(static_cast<size_t>(endPos - startPos));
+			m_IOCallback.setFilePointer(startPos);
+			size_t bufferSize = m_IOCallback.read(&buffer[0], buffer.size());
+
+			size_t offset = FindEbmlId(&buffer[0], bufferSize, id);
+			while (offset < bufferSize) {
+				// The ID bytes can as well be block data, only take an element that fits in the file
+				EbmlElementHeader header;
+				if (ReadEbmlElementHeader(&buffer[offset], bufferSize - offset, header) && !header.sizeUnknown
+					&& (startPos + offset + header.headSize + header.size <= m_FileSize))
+					return startPos + offset;
+				offset = FindEbmlId(&buffer[0], bufferSize, id, offset + 1);
+			}
+
+			if (startPos == minPos)
+				break;
+			// Overlap so that a header cut by the range start is found whole in the next one
+			endPos = startPos + EBML_MAX_HEADER_SIZE;
+			if (m_FileSize - startPos < maxRange) {
+				range *= 2;
+			} else {
+				// Past maxRange only the header cut by the range start is read
+				if (bCutRange || !IsEbmlIdCut(&buffer[0], bufferSize, id))
 					break;
-				}			
-				if (nextClusterEntry->timecode == timecode) {
-					// WOW, we are seeking directly to this cluster
-					correctEntry = nextClusterEntry;
+				range = 2 * EBML_MAX_HEADER_SIZE;
+				bCutRange = true;
+			}
+		}
+	} catch (...) {
+	}
+	return 0;
+}
+
+/// Furthest from the end of the file that ScanDuration() looks for a cluster
+#define DURATION_SCAN_MAX_RANGE (4 * 1024 * 1024)
+
+uint64 MatroskaAudioParser::ScanDuration()
+{
+	TIMER;
+	uint64 filePos = ScanForElement(KaxCluster::ClassInfos.GlobalId.Value, DURATION_SCAN_MAX_RANGE);
+	if (filePos == 0)
+		return 0;
+
+	uint64 duration = 0;
+	try {
+		// The cluster found may not be the last one, walk on by the element sizes
+		binary buffer[2 * EBML_MAX_HEADER_SIZE + 8];
+		EbmlElementHeader header;
+		uint64 clusterPos = 0;
+		EbmlElementHeader clusterHeader;
+		while (filePos < m_SegmentEnd) {
+			m_IOCallback.setFilePointer(filePos);
+			uint32 bufferSize = m_IOCallback.read(buffer, sizeof(buffer));
+			if (!ReadEbmlElementHeader(buffer, bufferSize, header))
+				break;
+			if (header.id == KaxCluster::ClassInfos.GlobalId.Value) {
+				// The ID bytes can as well be block data, a cluster starts with its Timecode
+				if (ReadClusterHeadTimecode(buffer, bufferSize, header) == MAX_UINT64)
 					break;
-				}
-				// Check if we undershot the needed cluster
-				if (timecode > nextClusterEntry->timecode) {
-					clusterIndex++;
-					//lookCount--;
-					continue;
-				}
+				clusterPos = filePos;
+				clusterHeader = header;
 			}
-			// We should never get here, unless this is the last cluster
-			assert(clusterEntry != NULL);	
-			if (timecode <= m_Duration)
-				correctEntry = clusterEntry;
-			else
+			if (header.sizeUnknown)
 				break;
+			filePos += header.headSize + header.size;
+		}
+		if (clusterPos == 0)
+			return 0;
+
+		// The last cluster may be cut by the end of the file
+		uint64 dataPos = clusterPos + clusterHeader.headSize;
+		uint64 size = m_FileSize - dataPos;
+		if (!clusterHeader.sizeUnknown && (clusterHeader.size < size))
+			size = clusterHeader.size;
+		if (size > MAX_CLUSTER_READ_SIZE)
+			size = MAX_CLUSTER_READ_SIZE;
+		ByteArray clusterData(static_cast<size_t>(size));
+		m_IOCallback.setFilePointer(dataPos);
+		if (size > 0)
+			clusterData.resize(m_IOCallback.read(&clusterData[0], clusterData.size()));
+		if (clusterData.empty())
+			return 0;
+
+		const uint32 SimpleBlockId = 0xA3;
+		uint64 clusterTimecode = 0;
+		EbmlElementHeader child;
+		EbmlMemoryWalker clusterWalker(&clusterData[0], clusterData.size());
+		while (clusterWalker.Next(child)) {
+			uint64 blockEnd = 0;
+			if (child.id == KaxClusterTimecode::ClassInfos.GlobalId.Value) {
+				clusterTimecode = ReadEbmlUInteger(clusterWalker.GetData(), child.size);
+				blockEnd = clusterTimecode * m_TimecodeScale;
+			} else if (child.id == SimpleBlockId) {
+				blockEnd = GetBlockEnd(clusterWalker.GetData(), static_cast<size_t>(child.size), clusterTimecode, 0);
+			} else if (child.id == KaxBlockGroup::ClassInfos.GlobalId.Value) {
+				const binary *blockData = NULL;
+				size_t blockSize = 0;
+				uint64 blockDuration = 0;
+				EbmlElementHeader groupChild;
+				EbmlMemoryWalker groupWalker(clusterWalker.GetData(), static_cast<size_t>(child.size));
+				while (groupWalker.Next(groupChild)) {
+					if (groupChild.id == KaxBlock::ClassInfos.GlobalId.Value) {
+						blockData = groupWalker.GetData();
+						blockSize = static_cast<size_t>(groupChild.size);
+					} else if (groupChild.id == KaxBlockDuration::ClassInfos.GlobalId.Value) {
+						blockDuration = ReadEbmlUInteger(groupWalker.GetData(), groupChild.size);
+					}
+				}
+				if (blockData != NULL)
+					blockEnd = GetBlockEnd(blockData, blockSize, clusterTimecode, blockDuration);
+			}
+			if (blockEnd > duration)
+				duration = blockEnd;
 		}
+	} catch (...) {
+		return 0;
+	}
+	_TIMER("ScanDuration");
+	NOTE1("MatroskaAudioParser::ScanDuration() %u ms", (uint32)(duration / 1000000));
+	return duration;
+}
 
-		if (correctEntry != NULL)
-			NOTE3("MatroskaAudioParser::FindCluster(timecode = %u) seeking to cluster %i at %u", (uint32)(timecode / m_TimecodeScale), (uint32)correctEntry->clusterNo, (uint32)correctEntry->filePos);
-		else
-			NOTE1("MatroskaAudioParser::FindCluster(timecode = %u) seeking failed", (uint32)(timecode / m_TimecodeScale));
+uint64 MatroskaAudioParser::GetBlockEnd(const binary *data, size_t size, uint64 clusterTimecode, uint64 blockDuration)
+{
+	uint64 trackNumber;
+	bool sizeUnknown;
+	size_t pos = ReadEbmlCodedSize(data, size, trackNumber, sizeUnknown);
+	if ((pos == 0) || (pos + 3 > size))
+		return 0;
+	int64 timecode = static_cast<int64>(clusterTimecode) + static_cast<int16>((data[pos] << 8) | data[pos+1]);
+	if (timecode < 0)
+		timecode = 0;
+	uint64 end = static_cast<uint64>(timecode) * m_TimecodeScale;
+	if (blockDuration != 0)
+		return end + blockDuration * m_TimecodeScale;
+
+	// Laced blocks hold several frames of the default duration
+	uint64 laceCount = 1;
+	if ((data[pos+2] & 0x06) && (pos + 3 < size))
+		laceCount = data[pos+3] + 1;
+	for (size_t t = 0; t < m_Tracks.size(); t++) {
+		if (m_Tracks.at(t).trackNumber == trackNumber)
+			return end + m_Tracks.at(t).defaultDuration * laceCount;
+	}
+	return end;
+}
 
-		return correctEntry;
-	} catch (...) {
-        cluster_entry_ptr null_ptr;
-		return null_ptr;
+void MatroskaAudioParser::ExtendClusterIndex(uint64 timecode, uint32 maxClusters)
+{
+	if (m_ClusterScanDone || (m_ClusterScanPos == 0))
+		return;
+
+	TIMER;
+	m_ClusterScanPos = ScanClusters(m_ClusterScanPos, timecode, maxClusters, &m_ClusterScanTimecode);
+	if (m_ClusterScanPos >= m_SegmentEnd)
+		m_ClusterScanDone = true;
+	_TIMER("ExtendClusterIndex");
+}
+
+/// A file not written to for this long is not being recorded anymore, in 100 ns units
+#define FOLLOW_IDLE_TIME (30 * 10000000ULL)
+
+bool MatroskaAudioParser::IsRecording()
+{
+	if (!m_IOCallback.seekable() || (m_ElementLevel0.get() == NULL))
+		return false;
+
+	// Recorders write the segment size when they are done
+	binary buffer[EBML_MAX_HEADER_SIZE];
+	EbmlElementHeader header;
+	m_IOCallback.setFilePointer(m_ElementLevel0->GetElementPosition());
+	uint32 bufferSize = m_IOCallback.read(buffer, sizeof(buffer));
+	if (!ReadEbmlElementHeader(buffer, bufferSize, header) || !header.sizeUnknown)
+		return false;
+
+	t_filestats stats = m_IOCallback.GetStats();
+	if (stats.m_timestamp == filetimestamp_invalid)
+		return false;
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	uint64 nowTimestamp = (static_cast<uint64>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+	return nowTimestamp < stats.m_timestamp + FOLLOW_IDLE_TIME;
+}
+
+bool MatroskaAudioParser::IsAtRecordingEdge(size_t cluster)
+{
+	if (!m_FollowMode)
+		return false;
+	if ((cluster != CLUSTER_NOT_FOUND) && (cluster + 1 < m_ClusterIndex.size()))
+		return false;
+	return IsRecording();
+}
+
+bool MatroskaAudioParser::UpdateFileSize()
+{
+	if (!m_IOCallback.seekable())
+		return false;
+	t_filestats stats = m_IOCallback.GetStats();
+	if ((stats.m_size == filesize_invalid) || (stats.m_size <= m_FileSize))
+		return false;
+
+	m_IOCallback.Refresh();
+	// An unknown sized segment grows with the file
+	if (m_SegmentEnd >= m_FileSize)
+		m_SegmentEnd = stats.m_size;
+	m_FileSize = stats.m_size;
+	// The index would be stored for a file that is different by now
+	m_IndexCacheReady = false;
+
+	// The scan goes on from the last cluster, its size may have been written since
+	if (m_ClusterScanDone && !m_ClusterIndex.empty()) {
+		m_ClusterScanPos = m_ClusterIndex.GetPosition(m_ClusterIndex.size() - 1);
+		m_ClusterScanDone = false;
 	}
+	ExtendClusterIndex(MAX_UINT64, 0xFFFFFFFF);
+	if ((m_ClusterScanTimecode != MAX_UINT64) && (m_ClusterScanTimecode > m_Duration))
+		m_Duration = static_cast<double>(m_ClusterScanTimecode);
+	NOTE2("MatroskaAudioParser::UpdateFileSize() %u clusters, %u bytes", (uint32)m_ClusterIndex.size(), (uint32)m_FileSize);
+	return true;
 }
 
-void MatroskaAudioParser::CountClusters() 
+const MatroskaCuePoint *MatroskaAudioParser::FindCuePoint(uint64 timecode)
 {
-	for (uint32 c = 0; c < m_ClusterIndex.size(); c++) {
-		cluster_entry_ptr clusterEntry = m_ClusterIndex.at(c);		
-		clusterEntry->clusterNo = c;
+	if (m_CueIndex.empty())
+		return NULL;
+
+	// Use the cues of our track, or of the first cued track (usually the video) if there are none
+	uint16 track = m_Tracks.at(m_CurrentTrackNo).trackNumber;
+	MatroskaCuePoint key;
+	key.track = track;
+	key.timecode = 0;
+	std::vector<MatroskaCuePoint>::iterator first = std::lower_bound(m_CueIndex.begin(), m_CueIndex.end(), key, CuePointLess);
+	if (first == m_CueIndex.end() || first->track != track) {
+		key.track = m_CueIndex.front().track;
+		first = m_CueIndex.begin();
+	}
+	key.timecode = timecode;
+	std::vector<MatroskaCuePoint>::iterator last = std::upper_bound(first, m_CueIndex.end(), key, CuePointLess);
+	if (last == first)
+		// timecode is before the first cue point
+		return NULL;
+	--last;
+	return &(*last);
+}
+
+size_t MatroskaAudioParser::FindClusterByCue(uint64 timecode)
+{
+	const MatroskaCuePoint *cuePoint = FindCuePoint(timecode);
+	if (cuePoint == NULL)
+		return CLUSTER_NOT_FOUND;
+	size_t cluster = m_ClusterIndex.Find(cuePoint->clusterPos);
+	if (cluster == CLUSTER_NOT_FOUND)
+		return CLUSTER_NOT_FOUND;
+
+	// The cued block starts before timecode, but with sparse cues one of the
+	// following clusters can still start before it as well
+	while (cluster+1 < m_ClusterIndex.size()) {
+		if (m_ClusterIndex.GetTimecode(cluster+1) == MAX_UINT64)
+			ResolveClusterTimecodes(cluster+1, cluster+1+CLUSTER_RESOLVE_BATCH, timecode);
+		uint64 nextTimecode = m_ClusterIndex.GetTimecode(cluster+1);
+		if (nextTimecode == MAX_UINT64 || nextTimecode > timecode)
+			break;
+		cluster++;
 	}
+	NOTE3("MatroskaAudioParser::FindClusterByCue(timecode = %u) seeking to cluster %i at %u", (uint32)(timecode / m_TimecodeScale), (uint32)cluster, (uint32)m_ClusterIndex.GetPosition(cluster));
+	return cluster;
 }
 
 void MatroskaAudioParser::FixChapterEndTimes()
@@ -2595,57 +4433,3 @@ void PrintChapters(std::vector<MatroskaChapterInfo> &theChapters)
 
 	}
 };
-
-bool MatroskaSearch::Skip()
-{
-	int j;
-
-	for (j = 0; j < SEARCH_TABLE_SIZE; j++) skip[j] = SEARCH_PATTERN_SIZE;
-	for (j = 0; j < SEARCH_PATTERN_SIZE - 1; j++)
-		skip[pattern[j] & 0x00ff] = SEARCH_PATTERN_SIZE-1-j;
-	return true;
-}
-
-bool MatroskaSearch::Next()
-{
-	int  j, k, s;
-	int  *g;
-
-	if ((g = (int *)malloc(sizeof(int)*SEARCH_PATTERN_SIZE)) == NULL) return false;
-	for (j = 0; j < SEARCH_PATTERN_SIZE; j++) next[j] = 2*SEARCH_PATTERN_SIZE - 1 - j;
-	j = SEARCH_PATTERN_SIZE;
-	for (k = SEARCH_PATTERN_SIZE - 1; k >= 0; k--) {
-		g[k] = j;
-		while (j != SEARCH_PATTERN_SIZE && pattern[j] != pattern[k]) {
-			next[j] = (next[j] <= SEARCH_PATTERN_SIZE-1-k) ? next[j] : SEARCH_PATTERN_SIZE-1-k;
-			j = g[j];
-		}
-		j--;
-	}
-	s = j;
-	for (j = 0; j < SEARCH_PATTERN_SIZE; j++) {
-		next[j] = (next[j] <= s+SEARCH_PATTERN_SIZE-j) ? next[j] : s+SEARCH_PATTERN_SIZE-j;
-		if (j >= s) s = g[s];
-	}
-	free(g);
-	return true;
-}
-
-int MatroskaSearch::Match(unsigned int start)
-{
-	int i, j;
-
-	i = SEARCH_PATTERN_SIZE - 1 + start;
-	while (i < SEARCH_SOURCE_SIZE) {
-		j = SEARCH_PATTERN_SIZE - 1;
-		while (j >= 0 && source[i] == pattern[j]) {
-			i--;
-			j--;
-		}
-		if (j < 0) return i + 1;
-		if (skip[source[i] & 0x00ff] >= next[j])
-			i += skip[source[i] & 0x00ff];
-		else i += next[j];
-	}
-	return -1;
-};
\ No newline at end of file
@@ -29,10 +29,18 @@
 #include "../helpers/helpers.h"
 #include "../../pfc/pfc.h"
 #include "Foobar2000ReaderIOCallback.h"
+#include "MappedFileIOCallback.h"
+#include "EbmlMemoryReader.h"
+#include "EbmlStreamReader.h"
 #include "DbgOut.h"
 #include <queue>
 #include <deque>
+#include <map>
+#include <algorithm>
 #include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "zlib.h"
 
 // libebml includes
 #include "ebml/StdIOCallback.h"
@@ -62,8 +70,11 @@
 #include "matroska/KaxTagMulti.h"
 #include "matroska/KaxCluster.h"
 #include "matroska/KaxClusterData.h"
+#include "matroska/KaxCues.h"
+#include "matroska/KaxCuesData.h"
 #include "matroska/KaxTrackAudio.h"
 #include "matroska/KaxTrackVideo.h"
+#include "matroska/KaxContentEncoding.h"
 #include "matroska/KaxAttachments.h"
 #include "matroska/KaxAttached.h"
 #include "matroska/KaxChapters.h"
@@ -71,6 +82,10 @@
 
 #define TIMECODE_SCALE  1000000
 #define MAX_UINT64 0xFFFFFFFFFFFFFFFF
+/// ContentCompAlgo values, NONE when the track has no ContentCompression
+#define MATROSKA_COMPRESSION_NONE 0xFFFFFFFF
+#define MATROSKA_COMPRESSION_ZLIB 0
+#define MATROSKA_COMPRESSION_HEADER_STRIPPING 3
 #define _DELETE(__x) if (__x) { delete __x; __x = NULL; }
 
 //Memory Leak Debuging define
@@ -117,27 +132,169 @@ public:
 	uint64 SourceDataLength;
 };
 
+/// The block data read from a cluster, frames point into it
+class MatroskaClusterBuffer {
+public:
+	MatroskaClusterBuffer() { refCount = 0; };
+
+	ByteArray data;
+	volatile LONG refCount;
+};
+
+inline void intrusive_ptr_add_ref(MatroskaClusterBuffer *buffer)
+{
+	InterlockedIncrement(&buffer->refCount);
+}
+
+inline void intrusive_ptr_release(MatroskaClusterBuffer *buffer)
+{
+	if (InterlockedDecrement(&buffer->refCount) == 0)
+		delete buffer;
+}
+
+typedef boost::intrusive_ptr<MatroskaClusterBuffer> cluster_buffer_ptr;
+
+/// One frame of a block, as a range of the cluster buffer
+struct MatroskaLace {
+	uint32 offset;
+	uint32 size;
+};
+
 class MatroskaAudioFrame {
 public:
 	MatroskaAudioFrame();
 	void Reset();
+	/// Exchanges the contents with another frame, buffers included
+	void Swap(MatroskaAudioFrame &other);
     double get_duration() {
         return static_cast<double>(duration / 1000000000.0);
     }
 
 	uint64 timecode;
 	uint64 duration;
-	std::vector<ByteArray> dataBuffer;
+	/// Index of the track in the track list
+	uint32 trackNo;
+	/// Set unless the block is known to depend on others
+	bool keyframe;
+	/// Makes room for count laces
+	void SetLaceCount(uint32 count);
+	uint32 GetLaceCount() { return laceCount; };
+	/// The lace data stays valid as long as the frame holds the cluster buffer
+	const binary *GetLaceData(uint32 lace) { return &buffer->data[0] + laces.at(lace).offset; };
+	uint32 GetLaceSize(uint32 lace) { return laces.at(lace).size; };
+
+	/// Number of laces in use, laces never shrinks so it can be recycled
+	uint32 laceCount;
+	cluster_buffer_ptr buffer;
+	std::vector<MatroskaLace> laces;
 	/// Linked-list for laced frames
     uint64 add_id;
     ByteArray additional_data_buffer;
 };
 
+/// Fixed size queue of frames between one producer and one consumer thread.
+/// The frames live in the ring and are filled in place, handing them over
+/// takes no lock and dropping the frames not taken yet is an index reset.
+class MatroskaFrameRing {
+public:
+	/// \param size Number of frames, a power of 2
+	MatroskaFrameRing(uint32 size);
+
+	/// Producer side: the frame to fill next
+	/// \return NULL if the ring is full
+	MatroskaAudioFrame *GetWriteFrame();
+	/// Producer side: hands the frame from GetWriteFrame() over
+	void Commit();
+
+	/// Consumer side: the next frame, it stays valid until given to Release()
+	/// \return NULL if the ring is empty
+	MatroskaAudioFrame *Take();
+	/// Consumer side: moves the next frame out of the ring into frame
+	/// \return false if the ring is empty
+	bool TakeInto(MatroskaAudioFrame &frame);
+	/// Consumer side: gives back a frame from Take(), in the order they were taken
+	void Release(MatroskaAudioFrame *frame);
+	/// Drops the frames not taken yet, only while there is no producer
+	void Flush();
+	bool IsEmpty() const { return m_Read == m_Write; };
+	bool Owns(const MatroskaAudioFrame *frame) const { return (frame >= &m_Frames[0]) && (frame < &m_Frames[0] + m_Frames.size()); };
+
+protected:
+	/// Tells the producer the frames before m_Read are free, unless some are still held
+	void Publish();
+
+	std::vector<MatroskaAudioFrame> m_Frames;
+	uint32 m_Mask;
+	/// Frames committed, only written by the producer
+	volatile LONG m_Write;
+	/// Frames the producer can reuse, only written by the consumer
+	volatile LONG m_Free;
+	/// Frames taken by the consumer
+	LONG m_Read;
+	/// Frames taken and not released yet
+	uint32 m_Held;
+};
+
+
+/// Returned for a cluster that is not in the index
+#define CLUSTER_NOT_FOUND ((size_t)-1)
 
-struct MatroskaMetaSeekClusterEntry {
-	uint32 clusterNo;
-	uint64 filePos;
+/// Positions and timecodes of the clusters, sorted by position.
+/// Files can have tens of thousands of clusters, so they are kept in two
+/// plain arrays rather than as an object per cluster.
+class MatroskaClusterIndex {
+public:
+	size_t size() const { return m_Positions.size(); };
+	bool empty() const { return m_Positions.empty(); };
+	void clear() { m_Positions.clear(); m_Timecodes.clear(); };
+	void reserve(size_t count) { m_Positions.reserve(count); m_Timecodes.reserve(count); };
+
+	uint64 GetPosition(size_t cluster) const { return m_Positions[cluster]; };
+	/// MAX_UINT64 until it is read
+	uint64 GetTimecode(size_t cluster) const { return m_Timecodes[cluster]; };
+	void SetTimecode(size_t cluster, uint64 timecode) { m_Timecodes[cluster] = timecode; };
+
+	/// Adds a cluster at the end, Sort() has to be called once they are all added
+	void Append(uint64 filePos, uint64 timecode) {
+		m_Positions.push_back(filePos);
+		m_Timecodes.push_back(timecode);
+	};
+	/// Index of the first cluster at or after filePos
+	size_t LowerBound(uint64 filePos) const;
+	/// \return The index of the cluster at filePos, or CLUSTER_NOT_FOUND
+	size_t Find(uint64 filePos) const;
+	/// Adds a cluster at its place, or sets its timecode if it is not known yet
+	/// \return The index of the cluster
+	size_t Insert(uint64 filePos, uint64 timecode);
+	/// Sorts by position and drops duplicates, keeping the known timecodes
+	void Sort();
+	size_t GetMemorySize() const { return (m_Positions.capacity() + m_Timecodes.capacity()) * sizeof(uint64); };
+
+protected:
+	std::vector<uint64> m_Positions;
+	std::vector<uint64> m_Timecodes;
+};
+
+/// One CueTrackPositions entry of the Cues element
+struct MatroskaCuePoint {
+	MatroskaCuePoint();
+
+	/// Cue time in ns
+	uint64 timecode;
+	/// Absolute file position of the cluster holding the cued block
+	uint64 clusterPos;
+	/// Position of the block inside the cluster data, 0 if unknown
+	uint64 relativePos;
+	uint32 blockNumber;
+	uint16 track;
+};
+
+/// A block of the current track inside its cluster
+struct MatroskaBlockOffset {
+	/// Block time in ns
 	uint64 timecode;
+	/// Position of the block element in the cluster data, like CueRelativePosition
+	uint64 offset;
 };
 
 class MatroskaSimpleTag {
@@ -230,19 +387,64 @@ class MatroskaTrackInfo {
         uint8 bitsPerSample;
         uint32 avgBytesPerSec; 
         uint64 defaultDuration;
+
+		/// ContentCompAlgo of the frames, MATROSKA_COMPRESSION_NONE if they are stored as is
+		uint32 compressionAlgo;
+		/// ContentCompSettings, the bytes stripped from each frame with header stripping
+		std::vector<BYTE> compressionSettings;
 };
 
-typedef boost::shared_ptr<MatroskaMetaSeekClusterEntry> cluster_entry_ptr;
+/// Everything Parse() reads from the file headers, as kept by the header cache
+struct MatroskaHeaderInfo {
+	MatroskaHeaderInfo();
+	/// Rough amount of memory held by this header
+	size_t GetMemorySize() const;
+
+	/// Parsed with the full cluster and cue indexes, not info only
+	bool indexed;
+	/// Where Parse() left the file pointer, the first cluster
+	uint64 dataPos;
+
+	std::vector<MatroskaTrackInfo> tracks;
+	bool audioOnly;
+	std::vector<MatroskaEditionInfo> editions;
+	std::vector<MatroskaChapterInfo> chapters;
+	std::vector<MatroskaTagInfo> tags;
+	pfc::list_t<MatroskaAttachment> attachments;
+
+	MatroskaClusterIndex clusters;
+	std::vector<MatroskaCuePoint> cues;
+	uint64 cuesPos;
+	uint64 clusterScanPos;
+	uint64 clusterScanTimecode;
+	bool clusterScanDone;
+	uint64 segmentEnd;
+
+	double duration;
+	uint64 timecodeScale;
+	UTFstring writingApp;
+	UTFstring muxingApp;
+	UTFstring fileTitle;
+	int32 fileDate;
+	UTFstring segmentFilename;
+	uint64 tagPos;
+	uint32 tagSize;
+};
 
 class MatroskaAudioParser {
 public:
-	MatroskaAudioParser(service_ptr_t<file> input, abort_callback & p_abort);
+	/// \param path Location of input, a local file is then read through a memory mapping
+	MatroskaAudioParser(service_ptr_t<file> input, abort_callback & p_abort, const char *path = NULL);
 	~MatroskaAudioParser();
 
 	/// The main header parsing function
 	/// \return 0 File parsed ok
 	/// \return 1 Failed
 	int Parse(bool bInfoOnly = false, bool bBreakAtClusters = true);
+	/// Enables the header and index caches, call before Parse()
+	/// \param path The path the file was opened with
+	/// \param stats Size and timestamp the cache entry has to match
+	void SetCacheKey(const char *path, const t_filestats &stats);
 	/// Writes the tags to the current matroska file
 	/// \param info All the tags we need to write
 	/// \return 0 Tags written A OK
@@ -299,7 +501,33 @@ public:
 	/// \return 1 If file could not be read or it not open	
 	/// \return 2 End of track (EOT)
 	MatroskaAudioFrame * ReadSingleFrame();
+	/// Same as ReadSingleFrame(), but takes the frames parsed by the prefetch
+	/// thread when it is enabled, the wait for them can be aborted
+	MatroskaAudioFrame * ReadSingleFrame(abort_callback &p_abort);
     MatroskaAudioFrame * ReadFirstFrame();
+	/// Parse the next clusters on a background thread while the current one
+	/// is decoded, the thread is started by ReadSingleFrame(abort_callback &)
+	void EnablePrefetch(bool enable);
+	/// Waits for the prefetch thread, call it before using the file elsewhere.
+	/// The next ReadSingleFrame(abort_callback &) starts the thread again.
+	/// \param keepFrames Put the frames it parsed back in m_Queue, or drop them when seeking
+	void StopPrefetch(bool keepFrames = true);
+	/// Gives a frame returned by ReadSingleFrame() back to the frame pool
+	void ReleaseFrame(MatroskaAudioFrame *frame);
+	/// Follows a file that is still being recorded: at the end of the written
+	/// clusters ReadSingleFrame(abort_callback &) waits for more instead of ending.
+	/// The last cluster is only read once the next one starts, it may be incomplete.
+	void SetFollowMode(bool follow) { m_FollowMode = follow; };
+	/// Picks up the clusters written since the file was parsed, the duration
+	/// then reaches the last one
+	/// \return true if the file grew
+	bool UpdateFileSize();
+	/// The segment size isn't written yet and the file was written lately
+	bool IsRecording();
+	/// Number of frames the pool had to allocate
+	uint32 GetFramePoolMisses() { return m_FramePoolMisses; };
+	/// Number of cluster buffers allocated because frames still pointed into the others
+	uint32 GetClusterBufferMisses() { return m_ClusterBufferMisses; };
 
 	UTFstring GetSegmentFileName() { return m_SegmentFilename; }
     typedef pfc::list_t<MatroskaAttachment> attachment_list;
@@ -311,10 +539,127 @@ protected:
 	void Parse_Chapter_Atom(KaxChapterAtom *ChapterAtom);
 	void Parse_Chapter_Atom(KaxChapterAtom *ChapterAtom, std::vector<MatroskaChapterInfo> &p_chapters);
 	void Parse_Tags(KaxTags *tagsElement);
+	void Parse_Cues(KaxCues *cuesElement);
+	void Parse_Info(KaxInfo *infoElement);
+	void Parse_Tracks(KaxTracks *tracksElement);
+	void Parse_Attachments(KaxAttachments *attachmentsElement);
+	/// Reads the Info, Tracks, Chapters, Tags and Attachments the SeekHead points to
+	void Parse_SeekTargets();
+	/// Records that a level 1 element is read, so it's only read once
+	/// \return false if it was already read
+	bool MarkElementParsed(EbmlElement &element);
+	/// \return The element starting at filePos, or an empty pointer if there is another one there
+	ElementPtr FindElementAt(uint64 filePos, const EbmlCallbacks &classInfos);
+	/// \return 0 if frames were read, 1 on an error, 2 at the end of the track,
+	/// 3 at the end of a followed file that is still being recorded
 	int FillQueue();
+	void StartPrefetch();
+	static DWORD WINAPI PrefetchThreadProc(LPVOID param);
+	void PrefetchThread();
+	/// Peeks at the track number of a block before its data is read
+	/// \return false if the block surely belongs to another track
+	bool IsCurrentTrackBlock(EbmlElement &block);
+	/// Keeps a frame of a compressed track for DecodeFrames()
+	void AddEncodedFrame(MatroskaAudioFrame *frame);
+	/// Undoes the ContentCompression of the frames read by FillQueue(), the decoded
+	/// laces are added at the end of the cluster buffer once no walker points into it.
+	/// The frames that can't be decoded are dropped from m_Queue.
+	void DecodeFrames();
+	/// Inflates zlib compressed data into m_InflateBuffer
+	/// \param outSize Receives the size of the inflated data
+	/// \return false if the data is broken
+	bool Inflate(const binary *data, size_t size, size_t &outSize);
+	/// Makes m_ClusterBuffer ready for the blocks of a new cluster
+	void PrepareClusterBuffer();
+	/// Reads a Block or SimpleBlock of the current track straight from the file
+	/// into the cluster buffer
+	/// \param clusterTimecode The unscaled timecode of the cluster
+	/// \return false if the block is from another track or broken
+	bool ReadBlock(EbmlElement &block, uint32 clusterTimecode, MatroskaAudioFrame &frame, bool simpleBlock);
+	/// Decodes a block already in the cluster buffer
+	/// \param offset Position of the block data in the cluster buffer
+	bool ParseBlock(size_t offset, size_t size, uint32 clusterTimecode, MatroskaAudioFrame &frame, bool simpleBlock);
+	/// Decodes a BlockGroup already in the cluster buffer, with its Block, duration and additions
+	/// \param offset Position of the group data in the cluster buffer
+	/// \return false if the group holds no block of a track we deliver
+	bool ParseBlockGroup(size_t offset, size_t size, uint32 clusterTimecode, MatroskaAudioFrame &frame);
+	/// Reads the next blocks of an input that can't seek, through m_StreamReader.
+	/// Clusters and segments of unknown size end where the next level 1 element starts.
+	/// \return 0 if blocks were read, 2 at the end of the stream, 1 if it is broken
+	int ReadStreamBlocks();
+	/// Reads the whole cluster into the cluster buffer and walks it in memory
+	/// \param blockStartOffset Blocks before this position in the cluster data are not parsed
+	/// \param nextClusterPos Receives the position following the cluster
+	/// \return false if the cluster has to be read element by element
+	bool ReadClusterFromMemory(size_t cluster, uint64 blockStartOffset, uint64 &nextClusterPos);
+	/// Position in the cluster data of the last known block of the current track at or
+	/// before timecode, from the block offsets of a previous visit or the cue points
+	/// \return 0 to read the cluster from its start
+	uint64 FindBlockOffset(size_t cluster, uint64 timecode);
+	/// Keeps the blocks found while reading a whole cluster for later seeks
+	void AddBlockOffsets(uint64 clusterPos, std::vector<MatroskaBlockOffset> &blockOffsets);
+	/// Takes a frame from the frame pool
+	MatroskaAudioFrame *NewFrame();
+	/// Adds a frame read from a cluster to the queue
+	void QueueFrame(MatroskaAudioFrame *newFrame, MatroskaAudioFrame *&prevFrame);
 	uint64 GetClusterTimecode(uint64 filePos);
-	cluster_entry_ptr FindCluster(uint64 timecode);
-	void CountClusters();
+	/// \return The index of the cluster holding timecode, or CLUSTER_NOT_FOUND
+	size_t FindCluster(uint64 timecode);
+	/// Binary search of the cluster timecodes, only the ones looked at are read
+	size_t FindClusterByTimecode(uint64 timecode);
+	/// Use the cue points to find the cluster holding timecode
+	size_t FindClusterByCue(uint64 timecode);
+	/// Timecode of a cluster, read from the file if it's not known yet
+	uint64 GetResolvedTimecode(size_t cluster);
+	/// Last cue point of the current track at or before timecode
+	const MatroskaCuePoint *FindCuePoint(uint64 timecode);
+	/// Walks the level-1 elements from filePos using only their size fields and adds
+	/// the clusters found to the index, no block is read
+	/// \param timecode Stop after a cluster starting past this timecode
+	/// \param maxClusters Stop after this many clusters
+	/// \param lastTimecode Receives the timecode of the last cluster found
+	/// \return The position following the last element walked
+	uint64 ScanClusters(uint64 filePos, uint64 timecode, uint32 maxClusters, uint64 *lastTimecode = NULL);
+	/// Looks for the next cluster header from filePos, for clusters of unknown size
+	/// \return Its position, m_SegmentEnd if there is none
+	uint64 FindNextCluster(uint64 filePos);
+	/// Reads the unknown timecodes of m_ClusterIndex entries first to last (excluded) in one pass
+	/// \param stopTimecode Stop after a cluster starting past this timecode
+	void ResolveClusterTimecodes(size_t first, size_t last, uint64 stopTimecode = MAX_UINT64);
+	/// Timecode of a cluster from the bytes following its header, MAX_UINT64 if the Timecode isn't there
+	uint64 ReadClusterHeadTimecode(const binary *buffer, size_t bufferSize, const EbmlElementHeader &header);
+	/// Continue the linear cluster scan from where it stopped
+	void ExtendClusterIndex(uint64 timecode, uint32 maxClusters);
+	/// In follow mode, cluster is past the clusters known to be complete
+	bool IsAtRecordingEdge(size_t cluster);
+	/// Finds the last cluster from the end of the file and reads its blocks
+	/// \return The end of the last block in nanoseconds, 0 if it was not found
+	uint64 ScanDuration();
+	/// End of a Block or SimpleBlock in nanoseconds
+	/// \param blockDuration The BlockDuration, 0 to use the default duration of the track
+	uint64 GetBlockEnd(const binary *data, size_t size, uint64 clusterTimecode, uint64 blockDuration);
+	/// Looks for an element the SeekHead doesn't point to, from the end of the file
+	/// The range starts at m_TagScanRange and doubles until the element is found
+	/// or maxRange is reached, unless the range start cuts an ID that may be it
+	/// \param id The ID with its length marker, like in EbmlId::Value
+	/// \param maxRange Give up after scanning this many bytes
+	/// \return The position of the element, 0 if it was not found
+	uint64 ScanForElement(uint32 id, uint64 maxRange);
+	/// Restores the cluster and cue indexes from the index cache
+	/// \return false if the cache has no entry for this file
+	bool LoadIndexCache();
+	/// Stores the indexes in the index cache if they changed since loaded
+	void SaveIndexCache();
+	/// Takes the duration ScanDuration() found on an earlier open from the index cache
+	void LoadCachedDuration();
+	/// Stores the duration alone, for info reads that build no index
+	void SaveCachedDuration();
+	/// Number of indexed clusters with a known timecode
+	size_t CountResolvedClusters();
+	/// Copies the parsed headers and indexes out of the parser
+	void ExportHeader(MatroskaHeaderInfo &header);
+	/// Restores the state of a previous Parse() of the same file
+	void ImportHeader(const MatroskaHeaderInfo &header);
 	void FixChapterEndTimes();
 	// See if the edition uid is already in our vector
 	// \return true Yes, we already have this uid
@@ -339,7 +684,9 @@ protected:
 	void SetTrackTags(file_info &info, MatroskaTagInfo* TrackTags);
 		
 
-	Foobar2000ReaderIOCallback m_IOCallback;
+	/// A MappedFileIOCallback for local files
+	boost::scoped_ptr<Foobar2000ReaderIOCallback> m_IOCallbackPtr;
+	Foobar2000ReaderIOCallback &m_IOCallback;
 	EbmlStream m_InputStream;
 	/// The main/base/master element, should be the segment
 	ElementPtr m_ElementLevel0;
@@ -348,16 +695,96 @@ protected:
 	MatroskaChapterInfo *m_CurrentChapter;
 	uint32 m_CurrentTrackNo;
 	std::vector<MatroskaTrackInfo> m_Tracks;
+	/// No track of another kind than audio in the file
+	bool m_AudioOnly;
 	std::vector<MatroskaEditionInfo> m_Editions;
 	std::vector<MatroskaChapterInfo> m_Chapters;
 	std::vector<MatroskaTagInfo> m_Tags;
 	
 	/// This is the queue of buffered frames to deliver
 	std::queue<MatroskaAudioFrame *> m_Queue;
+	/// Released frames, recycled with their buffers by NewFrame()
+	std::vector<MatroskaAudioFrame *> m_FramePool;
+	uint32 m_FramePoolMisses;
+	/// The pool is shared with the prefetch thread
+	critical_section m_FramePoolSync;
+	/// Block data of the cluster being read
+	cluster_buffer_ptr m_ClusterBuffer;
+	/// Buffers of previous clusters, free again once no frame points into them
+	std::vector<cluster_buffer_ptr> m_ClusterBufferPool;
+	uint32 m_ClusterBufferMisses;
+	/// Lace sizes, reused from block to block
+	std::vector<uint32> m_LaceSizes;
+	/// Reads the clusters of an input that can't seek, it only keeps a small lookahead
+	EbmlStreamReader m_StreamReader;
+	/// m_StreamReader is inside a cluster
+	bool m_StreamInCluster;
+	/// End of that cluster, MAX_UINT64 if its size is unknown
+	uint64 m_StreamClusterEnd;
+	uint32 m_StreamClusterTimecode;
+	/// Frames of compressed tracks read by the current FillQueue()
+	std::vector<MatroskaAudioFrame *> m_EncodedFrames;
+	/// The inflate state is reset for each frame instead of being allocated again
+	z_stream m_InflateStream;
+	bool m_InflateReady;
+	ByteArray m_InflateBuffer;
+
+	bool m_PrefetchEnabled;
+	HANDLE m_PrefetchThread;
+	/// Frames handed over by the prefetch thread
+	MatroskaFrameRing m_FrameRing;
+	/// Set when frames are handed over or the thread is done
+	HANDLE m_PrefetchReadyEvent;
+	/// Set when the reader released frames the thread is waiting for, or the thread has to stop
+	HANDLE m_PrefetchFreeEvent;
+	/// The prefetch thread waits for room in m_FrameRing
+	volatile LONG m_PrefetchWaiting;
+	volatile bool m_PrefetchStop;
+	volatile bool m_PrefetchDone;
+	/// Aborts the file reads of the prefetch thread when it has to stop
+	abort_callback_impl m_PrefetchAbort;
 
 	/// This is the index of clusters in the file, it's used to seek in the file
-	// std::vector<MatroskaMetaSeekClusterEntry> m_ClusterIndex;
-    std::vector<cluster_entry_ptr> m_ClusterIndex;
+	MatroskaClusterIndex m_ClusterIndex;
+	/// Cue points sorted by track then timecode
+	std::vector<MatroskaCuePoint> m_CueIndex;
+	/// Blocks of the current track in the clusters already read, by cluster position
+	std::map<uint64, std::vector<MatroskaBlockOffset> > m_BlockOffsets;
+	/// The next FillQueue() starts at the last block before this timecode, MAX_UINT64 if not seeking
+	uint64 m_SeekTimecode;
+	/// Where the last seek started reading in its cluster, so that the fill after the
+	/// frames to skip were counted starts at the same block
+	uint64 m_SeekClusterPos;
+	uint64 m_SeekBlockOffset;
+	/// The next seeking FillQueue() reads from m_SeekBlockOffset again
+	bool m_SeekRepeat;
+	/// Position of the Cues element, 0 if not known
+	uint64 m_CuesPos;
+	/// Positions of the info elements listed in the SeekHead, 0 if not listed
+	uint64 m_SeekInfoPos;
+	uint64 m_SeekTracksPos;
+	uint64 m_SeekChaptersPos;
+	uint64 m_SeekTagsPos;
+	uint64 m_SeekAttachmentsPos;
+	/// Level 1 elements already read
+	std::vector<uint64> m_ParsedElements;
+	/// The index is complete up to this position, where the cluster scan continues
+	uint64 m_ClusterScanPos;
+	/// Timecode of the last cluster found by the scan
+	uint64 m_ClusterScanTimecode;
+	bool m_ClusterScanDone;
+	/// End of the segment data, clamped to the file size
+	uint64 m_SegmentEnd;
+	/// See SetFollowMode()
+	bool m_FollowMode;
+	/// Path used as the cache key, empty if the caches are not used
+	pfc::string8 m_CachePath;
+	t_filestats m_CacheStats;
+	/// Set once Parse() built the full index, only that is worth caching
+	bool m_IndexCacheReady;
+	/// Resolved clusters and scan position when loaded from the cache
+	size_t m_IndexCacheResolved;
+	uint64 m_IndexCacheScanPos;
 
     attachment_list m_AttachmentList;
 
@@ -373,6 +800,7 @@ protected:
 	uint64 m_FileSize;
 	uint64 m_TagPos;
 	uint32 m_TagSize;
+	/// First range searched for the Tags when the SeekHead doesn't list them
 	uint32 m_TagScanRange;
 
 	//pfc::alloc_fast<BYTE> m_framebuffer;
@@ -388,29 +816,4 @@ typedef boost::shared_ptr<MatroskaAudioParser> matroska_parser_ptr;
 
 void PrintChapters(std::vector<MatroskaChapterInfo> &theChapters);
 
-class MatroskaSearch
-{
-private:
-	static const int SEARCH_SOURCE_SIZE = 1024*64;
-	static const int SEARCH_TABLE_SIZE = SEARCH_SOURCE_SIZE;
-	static const int SEARCH_PATTERN_SIZE = 3;
-    binary * source, * pattern;
-	int pos;
-    int  next[SEARCH_TABLE_SIZE], skip[SEARCH_TABLE_SIZE];
-	bool Skip();
-	bool Next();
-public:
-	MatroskaSearch(binary * p_source, binary * p_pattern)
-	{
-		ZeroMemory(next, sizeof(next));
-		ZeroMemory(skip, sizeof(skip));
-		source = p_source;
-		pattern = p_pattern;
-		Skip();
-		Next();
-	}
-	~MatroskaSearch() {};
-	int Match(unsigned int start = 0);
-};
-
 #endif // _MATROSKA_PARSER_H_